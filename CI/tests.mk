@@ -78,6 +78,9 @@ check: hg.cinnabarclone.git
 check: hg.cinnabarclone-full.git
 check: hg.cinnabarclone-bundle.git
 check: hg.cinnabarclone-bundle-full.git
+ifeq (:,$(PATHSEP))
+check: hg.daemon.git
+endif
 
 check-graft: hg.graft.git
 check-graft: hg.graft2.git
@@ -280,3 +283,38 @@ hg.cant.graft.git: hg.graft.replace.git
 	$(GIT) -C $@ cinnabar clear
 	$(GIT) -C $@ for-each-ref --format='%(refname)' | grep -v refs/remotes/origin/HEAD | sed 's/^/delete /' | $(GIT) -C $@ update-ref --stdin
 	$(GIT) -C $@ -c cinnabar.graft=true remote update
+
+# Two fetches served by the same daemon, and a third one it declines because
+# the client would read different git configuration files. Sessions are only
+# handed over to the daemon without GIT_CINNABAR_* variables or `git -c` in
+# the environment.
+DAEMON_GIT = env -u GIT_CINNABAR_CHECK -u GIT_CINNABAR_LOG -u GIT_CINNABAR_EXPERIMENTS git
+
+hg.daemon.git: hg.incr.hg hg.hg hg.git
+	$(HG) clone -U $< $@.hg
+	$(GIT) init $@
+	$(GIT) -C $@ remote add origin hg::$(PATH_URL)/$@.hg
+	GIT_CINNABAR_LOG=daemon:3 $(GIT) -C $@ cinnabar daemon 2> $@.log & \
+	pid=$$!; trap "kill $$pid" EXIT; \
+	while [ ! -S $@/.git/cinnabar-daemon.sock ]; do kill -0 $$pid || exit 1; sleep 0.1; done; \
+	$(DAEMON_GIT) -C $@ remote update && \
+	$(HG) -R $@.hg pull $(CURDIR)/$(word 2,$^) && \
+	$(DAEMON_GIT) -C $@ remote update && \
+	XDG_CONFIG_HOME=$(CURDIR)/$@.xdg $(DAEMON_GIT) -C $@ remote update && \
+	kill -0 $$pid
+	test $$(grep -c "Serving session" $@.log) -eq 2
+	test $$(grep -c "declining session" $@.log) -eq 1
+	$(call COMPARE_REFS, $(word 3,$^), $@)
+	$(GIT) -C $@ cinnabar fsck
+	$(GIT) -C $@ cinnabar fsck --full
+
+# Startup latency of quick commands, which is dominated by initialization.
+# Not part of the checks, run with `make -f CI/tests.mk bench-startup`.
+BENCH_RUNS ?= 50
+
+bench-startup: hg.git
+	cs=$$($(GIT) -C $< cinnabar git2hg refs/remotes/origin/HEAD); \
+	for cmd in "git2hg refs/remotes/origin/HEAD" "hg2git $$cs" "data -c $$cs"; do \
+		echo "git cinnabar $$cmd ($(BENCH_RUNS) runs)"; \
+		bash -c "time (for i in \$$(seq $(BENCH_RUNS)); do $(GIT) -C $< cinnabar $$cmd > /dev/null; done)"; \
+	done
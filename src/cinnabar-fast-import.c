@@ -11,6 +11,17 @@ static void cinnabar_unregister_shallow(const struct object_id *oid);
 #include "dir.h"
 #undef fspathncmp
 #define fspathncmp strncmp
+/* fast-import.c reads its input from stdin, which we never make it do,
+ * except for stream_blob, which we point at a file instead. */
+static FILE *stream_blob_input;
+#undef stdin
+#define stdin stream_blob_input
+/* fast-import.c compresses all objects at pack_compression_level. Make it
+ * use a level we pick for each object instead. */
+#include "environment.h"
+static int *git_pack_compression_level = &pack_compression_level;
+static int object_compression_level = Z_DEFAULT_COMPRESSION;
+#define pack_compression_level object_compression_level
 #include "fast-import.patched.c"
 #include "cinnabar-fast-import.h"
 #include "cinnabar-helper.h"
@@ -30,12 +41,49 @@ static void cinnabar_unregister_shallow(const struct object_id *oid);
 
 static int initialized = 0;
 static int update_shallow = 0;
+static unsigned int first_pack_id;
 
 void cinnabar_unregister_shallow(const struct object_id *oid) {
 	if (unregister_shallow(oid) == 0)
 		update_shallow = 1;
 }
 
+/* Compression level for each object type, from cinnabar.<type>compression,
+ * defaulting to pack.compression. */
+static int compression_levels[OBJ_TAG + 1];
+
+#define PROBE_SIZE 4096
+
+/* Quick check whether data looks already compressed (or otherwise random),
+ * from how evenly bytes are distributed in a sample of it. Deflating such
+ * data is expensive and doesn't make it any smaller. */
+static int looks_incompressible(const unsigned char *sample, size_t len)
+{
+	uint32_t counts[256] = { 0 };
+	uint64_t sum = 0;
+	size_t i;
+
+	if (len < PROBE_SIZE / 4)
+		return 0;
+	for (i = 0; i < len; i++)
+		counts[sample[i]]++;
+	for (i = 0; i < 256; i++)
+		sum += (uint64_t)counts[i] * counts[i];
+	/* With uniformly distributed bytes, the sum of squared counts is
+	 * about len + len * (len - 1) / 256. Text and uncompressed binary
+	 * data are way above that. */
+	return sum * 256 * 4 < (256 * (uint64_t)len + (uint64_t)len * (len - 1)) * 5;
+}
+
+static void set_compression_level(enum object_type type,
+                                  const unsigned char *sample, size_t len)
+{
+	object_compression_level = compression_levels[type];
+	if (type == OBJ_BLOB && object_compression_level != Z_NO_COMPRESSION &&
+	    looks_incompressible(sample, len))
+		object_compression_level = Z_NO_COMPRESSION;
+}
+
 static void rollback(void) {
 	do_cleanup(1);
 }
@@ -140,9 +188,36 @@ struct object_entry *get_object_entry(const struct object_id *oid)
 static void init(void)
 {
 	int i;
+	unsigned long packsizelimit;
 
 	reset_pack_idx_option(&pack_idx_opts);
 	git_pack_config();
+	/* Allow to limit the size of the packs we create independently of
+	 * pack.packSizeLimit. When the limit is reached, fast-import finishes
+	 * the current pack (checksum and index) and starts a new one, which
+	 * spreads that work over the import instead of doing it all at the
+	 * end, on a possibly multi-gigabyte pack. */
+	if (!git_config_get_ulong("cinnabar.packsizelimit", &packsizelimit))
+		max_packsize = packsizelimit;
+	/* Likewise for the maximum delta chain length. */
+	if (!git_config_get_ulong("cinnabar.packdepth", &max_depth)) {
+		if (max_depth > MAX_DEPTH)
+			max_depth = MAX_DEPTH;
+	}
+	for (i = OBJ_COMMIT; i <= OBJ_TAG; i++) {
+		struct strbuf key = STRBUF_INIT;
+		int level;
+
+		strbuf_addf(&key, "cinnabar.%scompression", type_name(i));
+		if (git_config_get_int(key.buf, &level))
+			level = *git_pack_compression_level;
+		else if (level == -1)
+			level = Z_DEFAULT_COMPRESSION;
+		else if (level < 0 || level > Z_BEST_COMPRESSION)
+			die("bad %s %d", key.buf, level);
+		compression_levels[i] = level;
+		strbuf_release(&key);
+	}
 	warn_on_object_refname_ambiguity = 0;
 
 	alloc_objects(object_entry_alloc);
@@ -162,12 +237,28 @@ static void init(void)
 	rc_free[cmd_save - 1].next = NULL;
 
 	start_packfile();
+	first_pack_id = pack_id;
 
 	parse_one_feature("force", 0);
 	initialized = 1;
 	atexit(rollback);
 }
 
+/* When the import was split across several packs, tie them together with
+ * a multi-pack-index, so that object lookups don't have to go through each
+ * of them in turn. */
+static void write_multi_pack_index(void)
+{
+	struct child_process cmd = CHILD_PROCESS_INIT;
+
+	cmd.git_cmd = 1;
+	cmd.no_stdin = 1;
+	cmd.no_stdout = 1;
+	strvec_pushl(&cmd.args, "multi-pack-index", "write", NULL);
+	if (run_command(&cmd))
+		warning("failed to write multi-pack-index");
+}
+
 static void cleanup(void)
 {
 	if (!initialized)
@@ -179,6 +270,8 @@ static void cleanup(void)
 	reprepare_packed_git(the_repository);
 
 	if (!require_explicit_termination) {
+		if (pack_id - first_pack_id > 1)
+			write_multi_pack_index();
 		if (update_shallow) {
 			struct shallow_lock shallow_lock;
 			const char *alternate_shallow_file;
@@ -204,6 +297,14 @@ void do_cleanup(int rollback)
 	cleanup();
 }
 
+/* Objects from the pack being written are read through pack_win, which is
+ * shared and never released, so reading them from several threads at once
+ * is not safe. */
+int fast_import_pack_open(void)
+{
+	return pack_data != NULL;
+}
+
 static void start_packfile(void)
 {
 	real_start_packfile();
@@ -211,8 +312,36 @@ static void start_packfile(void)
 	list_add_tail(&pack_data->mru, &the_repository->objects->packed_git_mru);
 }
 
+/* Once a pack is finished, its objects are found through the regular pack
+ * machinery, and fast-import falls back to that when they are not in its
+ * object table. So drop the entries of finished packs from the table, and
+ * release the entry pools that only contained such entries, instead of
+ * keeping every object written during the session in memory. */
+static void release_finished_objects(void)
+{
+	struct object_entry_pool *o, **prev;
+	struct object_entry *e;
+
+	/* The first pool is the one new entries are allocated from. */
+	for (prev = &blocks->next_pool; (o = *prev);) {
+		for (e = o->entries; e != o->next_free; e++)
+			if (e->pack_id == pack_id)
+				break;
+		if (e != o->next_free) {
+			prev = &o->next_pool;
+			continue;
+		}
+		for (e = o->entries; e != o->next_free; e++)
+			hashmap_remove(&object_table, &e->ent, NULL);
+		*prev = o->next_pool;
+		free(o);
+	}
+}
+
 static void end_packfile(void)
 {
+	struct trace_span *span;
+
 	if (prev_win)
 		unuse_pack(&prev_win);
 	if (pack_data) {
@@ -254,7 +383,11 @@ static void end_packfile(void)
 		close_pack_windows(pack_data);
 	}
 
+	span = trace_span_begin("end_packfile");
 	real_end_packfile();
+	trace_span_end(span);
+	if (blocks)
+		release_finished_objects();
 }
 
 void do_set_replace(const struct object_id *replaced,
@@ -503,6 +636,7 @@ void store_manifest(struct Store *store, struct rev_chunk *chunk,
 		strslice_slice(last_manifest_content, last_end, SIZE_MAX),
 		manifest);
 
+	set_compression_level(OBJ_TREE, NULL, 0);
 	store_tree(&last_manifest->branch_tree);
 	oidcpy(&last_manifest->branch_tree.versions[0].oid,
 	       &last_manifest->branch_tree.versions[1].oid);
@@ -563,12 +697,36 @@ void unpack_object_entry(struct object_entry *oe, char **buf,
 	*buf = gfi_unpack_entry(oe, len);
 }
 
+/* The caller must ensure the blob doesn't exist yet: stream_blob handles
+ * duplicates by truncating the pack, which the pack window kept by our
+ * hashwrite doesn't support. */
+void stream_git_blob(const char *path, struct object_id *result)
+{
+	struct stat st;
+	unsigned char sample[PROBE_SIZE];
+	size_t len;
+
+	ENSURE_INIT();
+	stream_blob_input = fopen(path, "rb");
+	if (!stream_blob_input || fstat(fileno(stream_blob_input), &st))
+		die_errno("cannot read %s", path);
+	len = st.st_size < PROBE_SIZE ? st.st_size : PROBE_SIZE;
+	if (xpread(fileno(stream_blob_input), sample, len,
+	           (st.st_size - len) / 2) != (ssize_t)len)
+		die_errno("cannot read %s", path);
+	set_compression_level(OBJ_BLOB, sample, len);
+	stream_blob(st.st_size, result, 0);
+	fclose(stream_blob_input);
+	stream_blob_input = NULL;
+}
+
 void store_git_object(enum object_type type, const struct strslice buf,
                       struct object_id *result, const struct strslice *reference,
                       const struct object_entry *reference_entry)
 {
 	struct last_object ref_object = { STRBUF_INIT, 0, 0, 1 };
 	struct strbuf data = { .buf = (char*)buf.buf, .len = buf.len, .alloc = 0 };
+	size_t len;
 	if (reference && reference_entry && reference_entry->idx.offset > 1 &&
 			reference_entry->pack_id == pack_id) {
 		ref_object.data.buf = (char*)reference->buf;
@@ -579,5 +737,9 @@ void store_git_object(enum object_type type, const struct strslice buf,
 		reference = NULL;
 	}
 	ENSURE_INIT();
+	/* Probe the middle of the data, past any uncompressed header. */
+	len = buf.len < PROBE_SIZE ? buf.len : PROBE_SIZE;
+	set_compression_level(type, (const unsigned char *)buf.buf + (buf.len - len) / 2,
+	                      len);
 	store_object(type, &data, reference ? &ref_object : NULL, result, 0);
 }
@@ -31,8 +31,12 @@ void store_git_object(enum object_type type, const struct strslice buf,
                       struct object_id *result, const struct strslice *reference,
                       const struct object_entry *reference_entry);
 
+void stream_git_blob(const char *path, struct object_id *result);
+
 void do_cleanup(int rollback);
 
+int fast_import_pack_open(void);
+
 void do_set_replace(const struct object_id *replaced,
                     const struct object_id *replace_with);
 
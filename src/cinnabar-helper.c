@@ -17,7 +17,9 @@
 #include "environment.h"
 #include "exec-cmd.h"
 #include "hashmap.h"
+#include "lockfile.h"
 #include "log-tree.h"
+#include "object-file.h"
 #include "shallow.h"
 #include "strslice.h"
 #include "strbuf.h"
@@ -194,34 +196,116 @@ unsigned int replace_map_tablesize(void)
 	return the_repository->objects->replace_map->map.tablesize;
 }
 
+static void write_system_config_cache(const char *cache_path, const char *key,
+				      const char *value)
+{
+	struct lock_file lock = LOCK_INIT;
+	int fd;
+
+	if (safe_create_leading_directories_const(cache_path))
+		return;
+	fd = hold_lock_file_for_update(&lock, cache_path, 0);
+	if (fd < 0)
+		return;
+	if (write_in_full(fd, key, strlen(key)) < 0 ||
+	    write_in_full(fd, value, strlen(value)) < 0)
+		rollback_lock_file(&lock);
+	else
+		commit_lock_file(&lock);
+}
+
+/* Identify the git executable found in $PATH, so that a cache depending
+ * on it is invalidated when it is upgraded. */
+static void add_git_executable_stamp(struct strbuf *key)
+{
+	struct strbuf buf = STRBUF_INIT;
+	const char *p = getenv("PATH");
+	struct stat st;
+
+	while (p && *p) {
+		const char *end = strchrnul(p, PATH_SEP);
+		strbuf_reset(&buf);
+		if (end != p) {
+			strbuf_add(&buf, p, end - p);
+			strbuf_addch(&buf, '/');
+		}
+#ifdef GIT_WINDOWS_NATIVE
+		strbuf_addstr(&buf, "git.exe");
+#else
+		strbuf_addstr(&buf, "git");
+#endif
+		if (!stat(buf.buf, &st) && S_ISREG(st.st_mode)) {
+			strbuf_addf(key, "%s %"PRIuMAX" %"PRIuMAX"\n", buf.buf,
+			            (uintmax_t)st.st_mtime,
+			            (uintmax_t)st.st_size);
+			break;
+		}
+		if (!*end)
+			break;
+		p = end + 1;
+	}
+	strbuf_release(&buf);
+}
+
 static void init_git_config(void)
 {
 	struct child_process proc = CHILD_PROCESS_INIT;
 	struct strbuf path = STRBUF_INIT;
+	struct strbuf cache = STRBUF_INIT;
+	struct strbuf key = STRBUF_INIT;
 	const char *env = getenv(EXEC_PATH_ENVIRONMENT);
-	/* As the helper is not necessarily built with the same build options
-	 * as git (because it's built separately), the way its libgit.a is
-	 * going to find the system gitconfig may not match git's, and there
-	 * might be important configuration items there (like http.sslcainfo
-	 * on git for windows).
-	 * Trick git into giving us the path to it system gitconfig. */
+	const char *env_path;
+	char *cache_path;
+
 	if (env && *env) {
 		setup_path();
 	}
-	strvec_pushl(&proc.args, "git", "config", "--system", "-e", NULL);
-	strvec_push(&proc.env, "GIT_EDITOR=echo");
-	proc.no_stdin = 1;
-	proc.no_stderr = 1;
-	/* We don't really care about the capture_command return value. If
-	 * the path we get is empty we'll know it failed. */
-	capture_command(&proc, &path, 0);
-	strbuf_trim_trailing_newline(&path);
+
+	/* Nothing to find out if the system gitconfig is already explicitly
+	 * set or disabled. */
+	if (getenv("GIT_CONFIG_SYSTEM") ||
+	    git_env_bool("GIT_CONFIG_NOSYSTEM", 0))
+		return;
+
+	/* The answer only depends on which git we end up running, so it is
+	 * cached, keyed on what determines that, to avoid spawning a process
+	 * on every start. */
+	env_path = getenv("PATH");
+	strbuf_addf(&key, "%s\n%s\n", env ? env : "",
+	            env_path ? env_path : "");
+	add_git_executable_stamp(&key);
+	cache_path = xdg_cache_home("git-cinnabar/system-config");
+
+	if (cache_path && strbuf_read_file(&cache, cache_path, 0) > 0 &&
+	    starts_with(cache.buf, key.buf)) {
+		strbuf_addstr(&path, cache.buf + key.len);
+	} else {
+		/* As the helper is not necessarily built with the same build
+		 * options as git (because it's built separately), the way its
+		 * libgit.a is going to find the system gitconfig may not match
+		 * git's, and there might be important configuration items there
+		 * (like http.sslcainfo on git for windows).
+		 * Trick git into giving us the path to it system gitconfig. */
+		strvec_pushl(&proc.args, "git", "config", "--system", "-e", NULL);
+		strvec_push(&proc.env, "GIT_EDITOR=echo");
+		proc.no_stdin = 1;
+		proc.no_stderr = 1;
+		/* We don't really care about the capture_command return value.
+		 * If the path we get is empty we'll know it failed. */
+		capture_command(&proc, &path, 0);
+		strbuf_trim_trailing_newline(&path);
+		if (path.len && cache_path)
+			write_system_config_cache(cache_path, key.buf, path.buf);
+	}
 
 	/* If we couldn't get a path, then so be it. We may just not have
 	 * a complete configuration. */
 	if (path.len)
 		setenv("GIT_CONFIG_SYSTEM", path.buf, 1);
 
+	free(cache_path);
+	strbuf_release(&key);
+	strbuf_release(&cache);
 	strbuf_release(&path);
 }
 
@@ -24,6 +24,11 @@ extern void reset_ref_store(struct repository *r);
 
 extern int cinnabar_check(int);
 
+struct trace_span;
+
+struct trace_span *trace_span_begin(const char *name);
+void trace_span_end(struct trace_span *span);
+
 extern struct notes_tree git2hg, hg2git, files_meta;
 
 struct remote;
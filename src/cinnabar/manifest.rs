@@ -6,6 +6,7 @@ use std::cell::RefCell;
 use std::io::{self, Write};
 use std::num::NonZeroUsize;
 
+use bstr::{BStr, ByteSlice};
 use either::Either;
 use lru::LruCache;
 
@@ -134,10 +135,12 @@ impl ParseTree for GitManifestTree {
     type Inner = GitManifestTreeEntry;
     type Error = MalformedTree;
 
-    fn parse_one_entry(buf: &mut &[u8]) -> Result<WithPath<Self::Inner>, Self::Error> {
-        let (path, item) = RawTree::parse_one_entry(buf)?.unzip();
-        Ok(WithPath::new(
-            &path[1..],
+    fn parse_one_entry_borrowed<'a>(
+        buf: &mut &'a [u8],
+    ) -> Result<(&'a BStr, Self::Inner), Self::Error> {
+        let (path, item) = RawTree::parse_one_entry_borrowed(buf)?;
+        Ok((
+            path[1..].as_bstr(),
             item.map_left(GitManifestTreeId::from_unchecked)
                 .map_right(|entry| ManifestEntry {
                     fid: HgFileId::from_raw_bytes(entry.oid.as_raw_bytes()).unwrap(),
@@ -154,7 +157,11 @@ impl ParseTree for GitManifestTree {
         ))
     }
 
-    fn write_one_entry<W: Write>(_entry: &WithPath<Self::Inner>, _w: W) -> io::Result<()> {
+    fn write_one_entry_borrowed<W: Write>(
+        _path: &BStr,
+        _inner: &Self::Inner,
+        _w: W,
+    ) -> io::Result<()> {
         todo!()
     }
 }
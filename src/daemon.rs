@@ -0,0 +1,369 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+//! Long-lived per-repository process serving remote-helper sessions.
+//!
+//! `git cinnabar daemon` listens on a unix socket in the git directory.
+//! When the socket exists, `git-remote-hg` hands its stdin, stdout and
+//! stderr over to the daemon instead of initializing git and loading the
+//! metadata itself, and waits for the exit code. The daemon keeps the
+//! `Store` loaded, and only reloads it when the metadata ref moved.
+//!
+//! Each session runs in a forked child, so that the state a session leaves
+//! behind (fast-import, grafting, the set of imported files, etc.) doesn't
+//! leak into the next one. Whatever the child loads is thus lost when the
+//! session ends, so the daemon itself loads, once per metadata change, what
+//! every session needs: the metadata notes trees, the heads, the tags, and
+//! the manifest of the most recent head. Other caches, like the one mapping
+//! manifest trees to git trees, start empty in each session.
+//!
+//! The client sends the environment variables that affect how the remote
+//! is reached (ssh agent and command, proxies, askpass), which the child
+//! applies. When the git configuration files change, or when the client's
+//! environment would make git read different ones, the daemon declines the
+//! session, letting git-remote-hg run it in-process. In the former case, it
+//! also re-executes itself to pick up the new configuration.
+
+use std::ffi::{OsStr, OsString};
+use std::fs;
+use std::io::{self, stderr, stdout, Read, Write};
+use std::net::Shutdown;
+use std::os::fd::{AsRawFd, OwnedFd};
+use std::os::raw::c_int;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::MetadataExt;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::os::unix::process::CommandExt;
+use std::path::{Path, PathBuf};
+use std::process::Command;
+
+use once_cell::sync::Lazy;
+
+use crate::git::CommitId;
+use crate::libc::{recv_with_fds, send_with_fds};
+use crate::libcinnabar::reset_ref_store;
+use crate::libgit::{
+    get_oid_committish, git_common_dir, git_dir, reprepare_packed_git, the_repository,
+};
+use crate::store::{RawGitChangesetMetadata, RawHgManifest, Store, METADATA_REF};
+use crate::trace::Span;
+use crate::util::SliceExt;
+use crate::{git_remote_hg_with_store, the_store};
+
+const SOCKET_NAME: &str = "cinnabar-daemon.sock";
+
+// Exit code used when the session couldn't be handed over or the daemon
+// died during the session, matching what git uses for die().
+const SESSION_FAILED: c_int = 128;
+
+// Sent by the daemon once it received a session, to tell whether it's
+// going to run it.
+const SESSION_ACCEPTED: u8 = 1;
+const SESSION_DECLINED: u8 = 0;
+
+// Environment variables the session uses to reach the remote, which are
+// set in the session process to the client's values.
+const SESSION_ENV: &[&str] = &[
+    "SSH_AUTH_SOCK",
+    "SSH_AGENT_PID",
+    "SSH_ASKPASS",
+    "GIT_SSH",
+    "GIT_SSH_COMMAND",
+    "GIT_SSH_VARIANT",
+    "GIT_ASKPASS",
+    "GIT_TERMINAL_PROMPT",
+    "DISPLAY",
+    "http_proxy",
+    "https_proxy",
+    "HTTPS_PROXY",
+    "all_proxy",
+    "ALL_PROXY",
+    "no_proxy",
+    "NO_PROXY",
+];
+
+// Environment variables that determine which configuration files git
+// reads. Sessions from clients where they differ from the daemon's are
+// declined.
+const CONFIG_ENV: &[&str] = &[
+    "HOME",
+    "XDG_CONFIG_HOME",
+    "GIT_CONFIG_GLOBAL",
+    "GIT_CONFIG_SYSTEM",
+    "GIT_CONFIG_NOSYSTEM",
+];
+
+struct Session {
+    remote: OsString,
+    url: OsString,
+    env: Vec<(OsString, OsString)>,
+    fds: Vec<OwnedFd>,
+}
+
+fn socket_path(git_dir: &Path) -> PathBuf {
+    git_dir.join(SOCKET_NAME)
+}
+
+/// Hand a `git-remote-hg <remote> <url>` invocation over to a running
+/// daemon. Returns `None` when the session should run in-process instead.
+pub fn forward_remote_hg(args: &[OsString]) -> Option<c_int> {
+    let [remote, url] = args else {
+        return None;
+    };
+    // The daemon has its own environment and working directory, so only
+    // forward sessions that don't depend on them: no per-invocation
+    // configuration, and no local path in the url.
+    if std::env::vars_os().any(|(k, _)| {
+        let k = k.as_bytes();
+        k.starts_with(b"GIT_CINNABAR_") || k == b"GIT_CONFIG_PARAMETERS" || k == b"GIT_CONFIG_COUNT"
+    }) || !url.as_bytes().windows(3).any(|w| w == b"://")
+    {
+        return None;
+    }
+    let git_dir = std::env::var_os("GIT_DIR")?;
+    let mut stream = UnixStream::connect(socket_path(Path::new(&git_dir))).ok()?;
+    let mut msg = remote.as_bytes().to_owned();
+    msg.push(b'\0');
+    msg.extend_from_slice(url.as_bytes());
+    send_with_fds(&stream, &msg, &[0, 1, 2]).ok()?;
+    let mut env = Vec::new();
+    for name in SESSION_ENV.iter().chain(CONFIG_ENV) {
+        if let Some(value) = std::env::var_os(name) {
+            env.push(b'\0');
+            env.extend_from_slice(name.as_bytes());
+            env.push(b'=');
+            env.extend_from_slice(value.as_bytes());
+        }
+    }
+    stream.write_all(&env).ok()?;
+    // Nothing was done yet if this fails or the daemon declines the
+    // session, so it's still fine to fall back.
+    stream.shutdown(Shutdown::Write).ok()?;
+    let mut accepted = [SESSION_DECLINED];
+    stream.read_exact(&mut accepted).ok()?;
+    if accepted[0] != SESSION_ACCEPTED {
+        return None;
+    }
+    let mut code = [0; 4];
+    Some(match stream.read_exact(&mut code) {
+        Ok(()) => c_int::from_ne_bytes(code),
+        Err(_) => SESSION_FAILED,
+    })
+}
+
+pub fn run_daemon() -> Result<c_int, String> {
+    let path = socket_path(&git_dir());
+    if UnixStream::connect(&path).is_ok() {
+        return Err("A daemon is already running for this repository".to_string());
+    }
+    // A daemon that didn't exit cleanly leaves its socket behind.
+    match fs::remove_file(&path) {
+        Err(e) if e.kind() != io::ErrorKind::NotFound => return Err(e.to_string()),
+        _ => {}
+    }
+    let listener = UnixListener::bind(&path).map_err(|e| e.to_string())?;
+    info!(target: "root", "Listening on {}", path.display());
+
+    let config_stamp = config_files_stamp();
+    let mut store: Lazy<Result<Store, &'static str>> = Lazy::new(the_store);
+    // Sessions are served one at a time, because they may all write to the
+    // repository. Other clients wait in the listen backlog.
+    for conn in listener.incoming() {
+        let mut conn = match conn {
+            Ok(conn) => conn,
+            Err(e) => {
+                warn!(target: "root", "{}", e);
+                continue;
+            }
+        };
+        let session = match read_session(&mut conn) {
+            Ok(session) => session,
+            Err(e) => {
+                warn!(target: "root", "{}", e);
+                conn.write_all(&[SESSION_DECLINED]).ok();
+                continue;
+            }
+        };
+        if CONFIG_ENV.iter().any(|name| {
+            let client = session.env.iter().find(|(k, _)| k == name);
+            client.map(|(_, v)| v.as_os_str()) != std::env::var_os(name).as_deref()
+        }) {
+            info!(target: "daemon", "Client configuration environment differs, declining session");
+            conn.write_all(&[SESSION_DECLINED]).ok();
+            continue;
+        }
+        if config_files_stamp() != config_stamp {
+            conn.write_all(&[SESSION_DECLINED]).ok();
+            drop((conn, session));
+            info!(target: "daemon", "Configuration changed, restarting");
+            let mut args = std::env::args_os();
+            let mut command = Command::new(std::env::current_exe().map_err(|e| e.to_string())?);
+            if let Some(arg0) = args.next() {
+                command.arg0(arg0);
+            }
+            // Only returns on error.
+            return Err(command.args(args).exec().to_string());
+        }
+        if conn.write_all(&[SESSION_ACCEPTED]).is_err() {
+            continue;
+        }
+        info!(target: "daemon", "Serving session for {}", session.url.to_string_lossy());
+        refresh(&mut store);
+        let code = serve_session(&mut store, session);
+        conn.write_all(&code.to_ne_bytes()).ok();
+    }
+    Ok(0)
+}
+
+type ConfigFileStamp = Option<(i64, i64, u64, u64)>;
+
+// Identify the state of the configuration files git reads. Files included
+// with `include.path` are not covered.
+fn config_files_stamp() -> Vec<ConfigFileStamp> {
+    let env_path = |name| std::env::var_os(name).map(PathBuf::from);
+    let home = env_path("HOME");
+    let paths = [
+        env_path("GIT_CONFIG_SYSTEM").or_else(|| Some("/etc/gitconfig".into())),
+        env_path("GIT_CONFIG_GLOBAL").or_else(|| home.as_ref().map(|h| h.join(".gitconfig"))),
+        env_path("XDG_CONFIG_HOME")
+            .or_else(|| home.as_ref().map(|h| h.join(".config")))
+            .map(|xdg| xdg.join("git").join("config")),
+        Some(git_common_dir().join("config")),
+        Some(git_dir().join("config.worktree")),
+    ];
+    paths
+        .iter()
+        .map(|path| {
+            let metadata = fs::metadata(path.as_ref()?).ok()?;
+            Some((
+                metadata.mtime(),
+                metadata.mtime_nsec(),
+                metadata.size(),
+                metadata.ino(),
+            ))
+        })
+        .collect()
+}
+
+fn read_session(conn: &mut UnixStream) -> io::Result<Session> {
+    let mut buf = vec![0; 4096];
+    let (len, fds) = recv_with_fds(conn, &mut buf, 3)?;
+    buf.truncate(len);
+    conn.read_to_end(&mut buf)?;
+    let invalid = || io::Error::new(io::ErrorKind::InvalidData, "invalid session request");
+    if fds.len() != 3 {
+        return Err(invalid());
+    }
+    let mut args = buf.split(|&b| b == b'\0');
+    let (Some(remote), Some(url)) = (args.next(), args.next()) else {
+        return Err(invalid());
+    };
+    let env = args
+        .map(|var| {
+            let [name, value] = var.splitn_exact(b'=').ok_or_else(invalid)?;
+            Ok((
+                OsStr::from_bytes(name).to_owned(),
+                OsStr::from_bytes(value).to_owned(),
+            ))
+        })
+        .collect::<io::Result<_>>()?;
+    Ok(Session {
+        remote: OsStr::from_bytes(remote).to_owned(),
+        url: OsStr::from_bytes(url).to_owned(),
+        env,
+        fds,
+    })
+}
+
+// Pick up what other processes did to the repository since the last
+// session: new packs, updated refs, and new metadata.
+fn refresh(store: &mut Lazy<Result<Store, &'static str>>) {
+    unsafe {
+        reprepare_packed_git(the_repository);
+        reset_ref_store(the_repository);
+    }
+    let current = get_oid_committish(METADATA_REF.as_bytes()).unwrap_or(CommitId::NULL);
+    if Lazy::get(store).map_or(false, |s| {
+        s.as_ref().map_or(true, |s| s.metadata_cid != current)
+    }) {
+        *store = Lazy::new(the_store);
+    }
+}
+
+// Load what all sessions need, so that they don't each have to.
+fn preload(store: &Store) {
+    let _span = Span::new("daemon", "preload");
+    store.hg2git_mut().for_each(|_, _| {});
+    store.git2hg_mut().for_each(|_, _| {});
+    store.files_meta_mut().for_each(|_, _| {});
+    store.get_tags();
+    // The manifests of new changesets are most likely stored as deltas
+    // against the manifest of the most recent head, which reading leaves
+    // in the manifest caches.
+    let head = store.changeset_heads().heads().last().copied();
+    if let Some(metadata) = head
+        .and_then(|head| head.to_git(store))
+        .and_then(|head| RawGitChangesetMetadata::read(store, head))
+    {
+        let manifest = metadata.parse().unwrap().manifest_id();
+        if let Some(manifest) = manifest.to_git(store) {
+            RawHgManifest::read(manifest);
+        }
+    }
+}
+
+fn serve_session(store: &mut Lazy<Result<Store, &'static str>>, session: Session) -> c_int {
+    // Load the store before forking, so that the next sessions get it too.
+    if Lazy::get(store).is_none() {
+        if let Ok(store) = Lazy::force(store) {
+            preload(store);
+        }
+    }
+    stdout().flush().ok();
+    stderr().flush().ok();
+    match unsafe { ::libc::fork() } {
+        -1 => {
+            warn!(target: "root", "{}", io::Error::last_os_error());
+            SESSION_FAILED
+        }
+        0 => {
+            // Use the client's stdin, stdout and stderr, so that the
+            // remote-helper protocol, progress and logging, as well as
+            // anything child processes print, all go to the client.
+            for (fd, target) in session.fds.iter().zip(0..) {
+                unsafe {
+                    ::libc::dup2(fd.as_raw_fd(), target);
+                }
+            }
+            for name in SESSION_ENV {
+                match session.env.iter().find(|(k, _)| k == name) {
+                    Some((_, value)) => std::env::set_var(name, value),
+                    None => std::env::remove_var(name),
+                }
+            }
+            let code = match git_remote_hg_with_store(session.remote, session.url, store) {
+                Ok(code) => code,
+                Err(msg) => {
+                    error!(target: "root", "{}", msg);
+                    1
+                }
+            };
+            stdout().flush().ok();
+            std::process::exit(code);
+        }
+        pid => {
+            let mut status = 0;
+            while unsafe { ::libc::waitpid(pid, &mut status, 0) } == -1 {
+                if io::Error::last_os_error().kind() != io::ErrorKind::Interrupted {
+                    return SESSION_FAILED;
+                }
+            }
+            if ::libc::WIFEXITED(status) {
+                ::libc::WEXITSTATUS(status)
+            } else {
+                SESSION_FAILED
+            }
+        }
+    }
+}
@@ -2,7 +2,11 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+use std::cell::RefCell;
+use std::rc::Rc;
+
 use derive_more::{From, TryInto};
+use lru::LruCache;
 use sha1::Sha1;
 
 mod blob;
@@ -12,7 +16,7 @@ pub use commit::*;
 mod tree;
 pub use tree::*;
 
-use crate::libgit::FileMode;
+use crate::libgit::{git_object_info, object_type, FfiBox, FileMode};
 use crate::oid::{oid_type, ObjectId};
 
 oid_type!(GitObjectId for Sha1);
@@ -128,21 +132,83 @@ impl PartialEq<GitOid> for GitObjectId {
     }
 }
 
+// Budget for the contents of the objects kept in the object cache.
+const OBJECT_CACHE_SIZE: usize = 64 * 1024 * 1024;
+
+// Objects larger than this are not kept in the object cache. The objects
+// that are read over and over (metadata commits, manifest commits, changeset
+// metadata blobs) are small, and large blobs would only evict them.
+const OBJECT_CACHE_MAX_OBJECT_SIZE: usize = 1024 * 1024;
+
+struct ObjectCache {
+    // Unbounded, because the budget is in bytes rather than in objects.
+    objects: LruCache<GitObjectId, (object_type, Rc<FfiBox<[u8]>>)>,
+    size: usize,
+    hits: u64,
+    misses: u64,
+}
+
+thread_local! {
+    static OBJECT_CACHE: RefCell<ObjectCache> = RefCell::new(ObjectCache {
+        objects: LruCache::unbounded(),
+        size: 0,
+        hits: 0,
+        misses: 0,
+    });
+}
+
+fn read_object(oid: GitObjectId, expected: object_type) -> Option<Rc<FfiBox<[u8]>>> {
+    OBJECT_CACHE.with_borrow_mut(|cache| {
+        if let Some((t, content)) = cache.objects.get(&oid) {
+            let result = (*t == expected).then(|| content.clone());
+            cache.hits += 1;
+            return result;
+        }
+        cache.misses += 1;
+        let (t, content) = git_object_info(oid, true)?;
+        let content = Rc::new(content.unwrap());
+        if content.len() <= OBJECT_CACHE_MAX_OBJECT_SIZE {
+            cache.size += content.len();
+            cache.objects.put(oid, (t, content.clone()));
+            while cache.size > OBJECT_CACHE_SIZE {
+                let (_, (_, evicted)) = cache.objects.pop_lru().unwrap();
+                cache.size -= evicted.len();
+            }
+        }
+        (t == expected).then_some(content)
+    })
+}
+
+pub fn log_object_cache_stats() {
+    OBJECT_CACHE.with_borrow(|cache| {
+        let total = cache.hits + cache.misses;
+        if total > 0 {
+            debug!(
+                target: "object-cache",
+                "hits: {}, misses: {} ({:.1}% hit rate), cached: {} objects, {} bytes",
+                cache.hits,
+                cache.misses,
+                cache.hits as f64 * 100.0 / total as f64,
+                cache.objects.len(),
+                cache.size
+            );
+        }
+    });
+}
+
 macro_rules! raw_object {
     ($t:ident | $oid_type:ident => $name:ident) => {
         #[derive(Clone)]
-        pub struct $name(Option<$crate::libgit::FfiBox<[u8]>>);
+        pub struct $name(Option<std::rc::Rc<$crate::libgit::FfiBox<[u8]>>>);
 
         impl $name {
             pub fn read(oid: $oid_type) -> Option<Self> {
-                $crate::libgit::git_object_info(oid, true).and_then(|(t, content)| {
-                    matches!(t, $crate::libgit::object_type::$t)
-                        .then(|| $name(Some(content.unwrap())))
-                })
+                $crate::git::read_object(oid.into(), $crate::libgit::object_type::$t)
+                    .map(|content| $name(Some(content)))
             }
 
             pub fn as_bytes(&self) -> &[u8] {
-                self.0.as_deref().unwrap_or(&[])
+                self.0.as_deref().map_or(&[][..], |content| &content[..])
             }
         }
 
@@ -3,7 +3,9 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 use std::io::{self, Write};
+use std::rc::Rc;
 
+use bstr::{BStr, ByteSlice};
 use digest::OutputSizeUser;
 use either::Either;
 use hex_literal::hex;
@@ -67,7 +69,9 @@ impl ParseTree for RawTree {
     type Inner = TreeEntry;
     type Error = MalformedTree;
 
-    fn parse_one_entry(buf: &mut &[u8]) -> Result<WithPath<Self::Inner>, Self::Error> {
+    fn parse_one_entry_borrowed<'a>(
+        buf: &mut &'a [u8],
+    ) -> Result<(&'a BStr, Self::Inner), Self::Error> {
         (|| {
             let mut mode = 0u16;
             let mut bytes = buf.iter();
@@ -89,8 +93,8 @@ impl ParseTree for RawTree {
             let (oid, remainder) =
                 remainder.split_at(<GitObjectId as ObjectId>::Digest::output_size());
             *buf = remainder;
-            Some(WithPath::new(
-                path,
+            Some((
+                path.as_bstr(),
                 match GitOid::from((GitObjectId::from_raw_bytes(oid).unwrap(), mode)) {
                     GitOid::Tree(tree_id) => Either::Left(tree_id),
                     oid => Either::Right(RecursedTreeEntry { oid, mode }),
@@ -100,7 +104,11 @@ impl ParseTree for RawTree {
         .ok_or(MalformedTree)
     }
 
-    fn write_one_entry<W: Write>(_entry: &WithPath<Self::Inner>, _w: W) -> io::Result<()> {
+    fn write_one_entry_borrowed<W: Write>(
+        _path: &BStr,
+        _inner: &Self::Inner,
+        _w: W,
+    ) -> io::Result<()> {
         todo!()
     }
 }
@@ -128,7 +136,7 @@ impl FromIterator<WithPath<TreeEntry>> for RawTree {
             tree_buf.extend_from_slice(b"\0");
             tree_buf.extend_from_slice(oid.as_raw_bytes());
         }
-        RawTree(Some(tree_buf.into()))
+        RawTree(Some(Rc::new(tree_buf.into())))
     }
 }
 
@@ -2,26 +2,34 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
-use std::collections::BTreeMap;
+use std::collections::{BTreeMap, HashMap};
 use std::ffi::OsStr;
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, BufWriter, Read, Write};
 use std::os::raw::c_uint;
+use std::path::PathBuf;
 use std::process::Command;
 use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::Mutex;
 
 use bstr::ByteSlice;
+use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
 use either::Either;
+use sha1::{Digest, Sha1};
+use tempfile::NamedTempFile;
 use url::Url;
 
 use crate::cinnabar::GitChangesetId;
-use crate::git::{CommitId, RawCommit, TreeId};
+use crate::git::{Commit, CommitId, RawCommit, TreeId};
 use crate::graft_config_enabled;
 use crate::hg::HgChangesetId;
 use crate::hg_data::{GitAuthorship, HgAuthorship};
 use crate::libcinnabar::reset_ref_store;
-use crate::libgit::{lookup_replace_commit, rev_list, the_repository};
+use crate::libgit::{git_common_dir, lookup_replace_commit, rev_list, the_repository};
+use crate::oid::ObjectId;
 use crate::progress::{progress_enabled, Progress};
 use crate::store::{has_metadata, GeneratedGitChangesetMetadata, RawHgChangeset, Store};
+use crate::util::{FromBytes, ToBoxed};
 
 extern "C" {
     fn replace_map_size() -> c_uint;
@@ -34,7 +42,180 @@ pub fn grafted() -> bool {
 
 static DID_SOMETHING: AtomicBool = AtomicBool::new(false);
 
-static GRAFT_TREES: Mutex<BTreeMap<TreeId, Vec<CommitId>>> = Mutex::new(BTreeMap::new());
+// Everything about a graft candidate commit that is needed to find whether
+// it matches a given changeset, except in ambiguous cases.
+#[derive(Clone, Debug, PartialEq)]
+struct GraftCandidate {
+    commit: CommitId,
+    parents: Box<[CommitId]>,
+    timestamp: GraftTimestamp,
+    subject: u64,
+    author: u64,
+}
+
+static GRAFT_TREES: Mutex<BTreeMap<TreeId, Vec<GraftCandidate>>> = Mutex::new(BTreeMap::new());
+
+fn short_hash(data: Option<&[u8]>) -> u64 {
+    let mut hash = Sha1::new();
+    if let Some(data) = data {
+        hash.update(b"\x01");
+        hash.update(data);
+    }
+    u64::from_le_bytes(hash.finalize()[..8].try_into().unwrap())
+}
+
+// Timestamps in their canonical form are kept as integers, such that
+// comparing the integer values is equivalent to comparing them textually.
+// Others are kept as raw bytes, and compared as such.
+#[derive(Clone, Debug, PartialEq)]
+enum GraftTimestamp {
+    Canonical(u64),
+    Raw(Box<[u8]>),
+}
+
+impl GraftTimestamp {
+    fn new(timestamp: &[u8]) -> Self {
+        u64::from_bytes(timestamp)
+            .ok()
+            // u64::MAX is used to mark raw timestamps in the index.
+            .filter(|&t| t != u64::MAX && t.to_string().as_bytes() == timestamp)
+            .map_or_else(
+                || GraftTimestamp::Raw(timestamp.to_boxed()),
+                GraftTimestamp::Canonical,
+            )
+    }
+}
+
+impl GraftCandidate {
+    fn from_commit(cid: CommitId, c: &Commit) -> Self {
+        let authorship = HgAuthorship::from(GitAuthorship(c.author()));
+        GraftCandidate {
+            commit: cid,
+            parents: c.parents().to_boxed(),
+            timestamp: GraftTimestamp::new(&authorship.timestamp),
+            subject: short_hash(ByteSlice::lines(c.body()).next()),
+            author: short_hash(Some(&*authorship.author)),
+        }
+    }
+}
+
+// The graft candidates index is a cache of GraftCandidate data for all
+// the commits that were candidates the last time init_graft ran, so that
+// subsequent runs don't need to read and parse them all again.
+//
+// Format:
+//   "CGI2" magic
+//   for each candidate:
+//     commit id, tree id, timestamp (u64, u64::MAX when not canonical,
+//     followed by its length (u32) and bytes), subject hash (u64), author
+//     hash (u64), number of parents (u32), parent ids.
+const GRAFT_INDEX_MAGIC: &[u8; 4] = b"CGI2";
+
+fn graft_index_path() -> PathBuf {
+    git_common_dir().join("cinnabar").join("graft-index")
+}
+
+fn read_graft_index() -> HashMap<CommitId, (TreeId, GraftCandidate)> {
+    File::open(graft_index_path())
+        .and_then(|file| read_graft_index_from(&mut BufReader::new(file)))
+        // A missing or broken index is not fatal, it just needs to be rebuilt.
+        .unwrap_or_default()
+}
+
+fn read_graft_index_from(
+    input: &mut impl BufRead,
+) -> io::Result<HashMap<CommitId, (TreeId, GraftCandidate)>> {
+    fn read_oid<O: ObjectId>(input: &mut impl Read) -> io::Result<O> {
+        let mut oid = O::NULL;
+        input.read_exact(oid.as_raw_bytes_mut())?;
+        Ok(oid)
+    }
+
+    let mut result = HashMap::new();
+    let mut magic = [0; 4];
+    input.read_exact(&mut magic)?;
+    if &magic != GRAFT_INDEX_MAGIC {
+        return Err(io::ErrorKind::InvalidData.into());
+    }
+    while !input.fill_buf()?.is_empty() {
+        let commit = read_oid::<CommitId>(input)?;
+        let tree = read_oid::<TreeId>(input)?;
+        let timestamp = match input.read_u64::<LittleEndian>()? {
+            u64::MAX => {
+                let len = input.read_u32::<LittleEndian>()?;
+                let mut raw = Vec::new();
+                input.by_ref().take(len.into()).read_to_end(&mut raw)?;
+                if raw.len() != len as usize {
+                    return Err(io::ErrorKind::UnexpectedEof.into());
+                }
+                GraftTimestamp::Raw(raw.into())
+            }
+            t => GraftTimestamp::Canonical(t),
+        };
+        let subject = input.read_u64::<LittleEndian>()?;
+        let author = input.read_u64::<LittleEndian>()?;
+        let num_parents = input.read_u32::<LittleEndian>()?;
+        let parents = (0..num_parents)
+            .map(|_| read_oid::<CommitId>(input))
+            .collect::<io::Result<_>>()?;
+        result.insert(
+            commit,
+            (
+                tree,
+                GraftCandidate {
+                    commit,
+                    parents,
+                    timestamp,
+                    subject,
+                    author,
+                },
+            ),
+        );
+    }
+    Ok(result)
+}
+
+fn write_graft_index(graft_trees: &BTreeMap<TreeId, Vec<GraftCandidate>>) -> io::Result<()> {
+    let path = graft_index_path();
+    let dir = path.parent().unwrap();
+    fs::create_dir_all(dir)?;
+    let mut file = NamedTempFile::new_in(dir)?;
+    {
+        let mut output = BufWriter::new(&mut file);
+        write_graft_index_to(&mut output, graft_trees)?;
+        output.flush()?;
+    }
+    file.persist(path).map_err(|e| e.error)?;
+    Ok(())
+}
+
+fn write_graft_index_to(
+    output: &mut impl Write,
+    graft_trees: &BTreeMap<TreeId, Vec<GraftCandidate>>,
+) -> io::Result<()> {
+    output.write_all(GRAFT_INDEX_MAGIC)?;
+    for (tree, candidates) in graft_trees {
+        for c in candidates {
+            output.write_all(c.commit.as_raw_bytes())?;
+            output.write_all(tree.as_raw_bytes())?;
+            match &c.timestamp {
+                GraftTimestamp::Canonical(t) => output.write_u64::<LittleEndian>(*t)?,
+                GraftTimestamp::Raw(raw) => {
+                    output.write_u64::<LittleEndian>(u64::MAX)?;
+                    output.write_u32::<LittleEndian>(raw.len().try_into().unwrap())?;
+                    output.write_all(raw)?;
+                }
+            }
+            output.write_u64::<LittleEndian>(c.subject)?;
+            output.write_u64::<LittleEndian>(c.author)?;
+            output.write_u32::<LittleEndian>(c.parents.len().try_into().unwrap())?;
+            for p in &*c.parents {
+                output.write_all(p.as_raw_bytes())?;
+            }
+        }
+    }
+    Ok(())
+}
 
 pub fn graft_finish() -> Option<bool> {
     if GRAFT_TREES.lock().unwrap().is_empty() {
@@ -89,12 +270,25 @@ pub fn init_graft(store: &Store, fetched: bool) {
             args.push("refs/cinnabar/metadata^");
         }
     }
+    let mut index = read_graft_index();
+    let mut new_candidates = 0;
     let mut graft_trees = GRAFT_TREES.lock().unwrap();
     for cid in rev_list(&args).progress(|n| format!("Reading {} graft candidates", n)) {
-        let c = RawCommit::read(cid).unwrap();
-        let c = c.parse().unwrap();
-        let cids_for_tree = graft_trees.entry(c.tree()).or_default();
-        cids_for_tree.push(cid);
+        let (tree, candidate) = index.remove(&cid).unwrap_or_else(|| {
+            new_candidates += 1;
+            let c = RawCommit::read(cid).unwrap();
+            let c = c.parse().unwrap();
+            (c.tree(), GraftCandidate::from_commit(cid, &c))
+        });
+        let cids_for_tree = graft_trees.entry(tree).or_default();
+        cids_for_tree.push(candidate);
+    }
+    // Only update the index when it doesn't match the current set of
+    // candidates.
+    if new_candidates > 0 || !index.is_empty() {
+        if let Err(e) = write_graft_index(&graft_trees) {
+            warn!(target: "root", "Failed to write graft candidates index: {}", e);
+        }
     }
 }
 
@@ -118,66 +312,32 @@ pub fn graft(
 
     let changeset = raw_changeset.parse().unwrap();
     let graft_trees_entry = graft_trees.get_mut(&tree).ok_or(GraftError::NoGraft)?;
-    let candidates = graft_trees_entry
-        .iter()
-        .map(|&c| {
-            let raw = RawCommit::read(c).unwrap();
-            (c, raw)
-        })
-        .collect::<Vec<_>>();
-    let candidates = candidates
-        .iter()
-        .map(|(cid, c)| (cid, c.parse().unwrap()))
-        .filter(|(_, c)| {
-            if &*HgAuthorship::from(GitAuthorship(c.author())).timestamp != changeset.timestamp() {
-                return false;
-            }
-            if c.parents()
-                .iter()
-                .copied()
-                .zip(parents.iter().copied())
-                .all(|(commit_parent, changeset_parent)| {
+    let mut candidates = filter_candidates(
+        graft_trees_entry,
+        &GraftTimestamp::new(changeset.timestamp()),
+        short_hash(ByteSlice::lines(changeset.body()).next()),
+        short_hash(Some(changeset.author())),
+        |c| {
+            c.parents.iter().copied().zip(parents.iter().copied()).all(
+                |(commit_parent, changeset_parent)| {
                     lookup_replace_commit(commit_parent)
                         == lookup_replace_commit(changeset_parent.into())
-                })
-            {
-                return true;
-            }
+                },
+            )
             // Allow to graft if not already grafted.
-            !grafted()
-        })
-        .collect::<Vec<_>>();
-    let mut candidates = candidates.iter().collect::<Vec<_>>();
-
-    if candidates.len() > 1 {
-        // Ideally, this should all be tried with fuzziness, and
-        // independently of the number of nodes we got, but the
-        // following is enough to graft github.com/mozilla/gecko-dev
-        // to mozilla-central and related repositories.
-        // Try with commits with the same subject line
-        let cs_subject = ByteSlice::lines(changeset.body()).next();
-        let mut possible_candidates = candidates.clone();
-        possible_candidates.retain(|(_, c)| ByteSlice::lines(c.body()).next() == cs_subject);
-        if possible_candidates.len() > 1 {
-            // Try with commits with the same author ; this is attempted
-            // separately from checking timestamps because author may
-            // have been munged.
-            possible_candidates.retain(|(_, c)| {
-                &*HgAuthorship::from(GitAuthorship(c.author())).author == changeset.author()
-            });
-        }
-        if possible_candidates.len() == 1 {
-            candidates = possible_candidates;
-        }
-    }
+            || !grafted()
+        },
+    );
 
     // If we still have multiple nodes, check if one of them is one that
     // cinnabar would have created. If it is, we prefer other commits on
     // the premise that it means we've been asked to reclone with a graft.
     // on a repo that was already handled by cinnabar.
     if candidates.len() > 1 {
-        candidates.retain(|(_, c)| {
-            GeneratedGitChangesetMetadata::generate(store, c, changeset_id, raw_changeset)
+        candidates.retain(|c| {
+            let raw = RawCommit::read(c.commit).unwrap();
+            let commit = raw.parse().unwrap();
+            GeneratedGitChangesetMetadata::generate(store, &commit, changeset_id, raw_changeset)
                 .unwrap()
                 .patch()
                 .is_some()
@@ -186,18 +346,188 @@ pub fn graft(
 
     match candidates.len() {
         1 => {
-            let (commit, _) = candidates[0];
-            graft_trees_entry.retain(|c| c != *commit);
+            let commit = candidates[0].commit;
+            graft_trees_entry.retain(|c| c.commit != commit);
             DID_SOMETHING.store(true, Ordering::Relaxed);
-            Ok(Some(*(*commit)))
+            Ok(Some(commit))
         }
         0 => Err(GraftError::NoGraft),
         _ => Err(GraftError::Ambiguous(
             candidates
                 .into_iter()
-                .map(|(cid, _)| *(*cid))
+                .map(|c| c.commit)
                 .collect::<Vec<_>>()
                 .into(),
         )),
     }
 }
+
+// Candidates with the given timestamp and for which `parents_match` is
+// true. When there are several, the subject and author hashes are used
+// to break the tie.
+fn filter_candidates<'a>(
+    candidates: &'a [GraftCandidate],
+    timestamp: &GraftTimestamp,
+    subject: u64,
+    author: u64,
+    parents_match: impl Fn(&GraftCandidate) -> bool,
+) -> Vec<&'a GraftCandidate> {
+    let mut candidates = candidates
+        .iter()
+        .filter(|c| c.timestamp == *timestamp && parents_match(c))
+        .collect::<Vec<_>>();
+
+    if candidates.len() > 1 {
+        // Ideally, this should all be tried with fuzziness, and
+        // independently of the number of nodes we got, but the
+        // following is enough to graft github.com/mozilla/gecko-dev
+        // to mozilla-central and related repositories.
+        // Try with commits with the same subject line
+        let mut possible_candidates = candidates.clone();
+        possible_candidates.retain(|c| c.subject == subject);
+        if possible_candidates.len() > 1 {
+            // Try with commits with the same author ; this is attempted
+            // separately from checking timestamps because author may
+            // have been munged.
+            possible_candidates.retain(|c| c.author == author);
+        }
+        if possible_candidates.len() == 1 {
+            candidates = possible_candidates;
+        }
+    }
+    candidates
+}
+
+#[cfg(test)]
+fn test_candidate(
+    n: u8,
+    parents: &[u8],
+    timestamp: GraftTimestamp,
+    subject: u64,
+    author: u64,
+) -> GraftCandidate {
+    GraftCandidate {
+        commit: CommitId::from_raw_bytes_array([n; 20]),
+        parents: parents
+            .iter()
+            .map(|&p| CommitId::from_raw_bytes_array([p; 20]))
+            .collect(),
+        timestamp,
+        subject,
+        author,
+    }
+}
+
+#[test]
+fn test_graft_timestamp() {
+    use GraftTimestamp::*;
+    assert_eq!(GraftTimestamp::new(b"0"), Canonical(0));
+    assert_eq!(GraftTimestamp::new(b"1234567890"), Canonical(1234567890));
+    for raw in [
+        &b""[..],
+        b"01234567890",
+        b"+1234567890",
+        b"-1234567890",
+        b"1234567890.5",
+        b"18446744073709551615",
+        b"99999999999999999999",
+    ] {
+        assert_eq!(GraftTimestamp::new(raw), Raw(raw.to_boxed()));
+    }
+}
+
+#[test]
+fn test_graft_index() {
+    use GraftTimestamp::*;
+    let mut graft_trees = BTreeMap::new();
+    graft_trees.insert(
+        TreeId::from_raw_bytes_array([1; 20]),
+        vec![
+            test_candidate(10, &[], Canonical(1234567890), 1, 2),
+            test_candidate(11, &[10], Raw(b"-42".to_boxed()), 3, 4),
+        ],
+    );
+    graft_trees.insert(
+        TreeId::from_raw_bytes_array([2; 20]),
+        vec![test_candidate(12, &[10, 11], Raw(Box::new([])), 5, 6)],
+    );
+    let mut index = Vec::new();
+    write_graft_index_to(&mut index, &graft_trees).unwrap();
+
+    let mut result = read_graft_index_from(&mut &index[..]).unwrap();
+    assert_eq!(result.len(), 3);
+    for (tree, candidates) in &graft_trees {
+        for c in candidates {
+            assert_eq!(result.remove(&c.commit), Some((*tree, c.clone())));
+        }
+    }
+
+    // Entries are 20 + 20 + 8 + 8 + 8 + 4 bytes, plus 20 per parent, plus
+    // 4 + length for raw timestamps.
+    let boundaries = [4, 4 + 68, 4 + 68 + 95, 4 + 68 + 95 + 112];
+    assert_eq!(*boundaries.last().unwrap(), index.len());
+    for len in 0..index.len() {
+        let result = read_graft_index_from(&mut &index[..len]);
+        if let Some(n) = boundaries.iter().position(|&b| b == len) {
+            assert_eq!(result.unwrap().len(), n);
+        } else {
+            assert!(result.is_err(), "truncated at {}", len);
+        }
+    }
+
+    let mut corrupted = index.clone();
+    corrupted[..4].copy_from_slice(b"CGI1");
+    assert!(read_graft_index_from(&mut &corrupted[..]).is_err());
+
+    // A raw timestamp length going past the end of the index.
+    let mut corrupted = index.clone();
+    corrupted[4 + 68 + 48..][..4].copy_from_slice(&u32::MAX.to_le_bytes());
+    assert!(read_graft_index_from(&mut &corrupted[..]).is_err());
+}
+
+#[test]
+fn test_filter_candidates() {
+    use GraftTimestamp::*;
+    let candidates = [
+        test_candidate(1, &[], Canonical(1000), 1, 1),
+        test_candidate(2, &[], Canonical(2000), 1, 1),
+        test_candidate(3, &[], Canonical(2000), 2, 1),
+        test_candidate(4, &[], Canonical(2000), 2, 2),
+        test_candidate(5, &[], Raw(b"02000".to_boxed()), 1, 1),
+        test_candidate(6, &[1], Canonical(3000), 1, 1),
+    ];
+    let filter = |timestamp, subject, author, parents_match: &dyn Fn(&GraftCandidate) -> bool| {
+        filter_candidates(&candidates, &timestamp, subject, author, parents_match)
+            .into_iter()
+            .map(|c| c.commit.as_raw_bytes()[0])
+            .collect::<Vec<_>>()
+    };
+    let any_parents = |_: &GraftCandidate| true;
+
+    assert_eq!(filter(Canonical(1000), 5, 5, &any_parents), [1]);
+    assert_eq!(filter(Canonical(1500), 1, 1, &any_parents), []);
+    // Raw timestamps only match the exact same bytes.
+    assert_eq!(filter(Raw(b"02000".to_boxed()), 5, 5, &any_parents), [5]);
+    assert_eq!(filter(Raw(b"2000.0".to_boxed()), 1, 1, &any_parents), []);
+    // Ties are broken by subject, then by author.
+    assert_eq!(filter(Canonical(2000), 1, 5, &any_parents), [2]);
+    assert_eq!(filter(Canonical(2000), 2, 2, &any_parents), [4]);
+    // When that doesn't leave exactly one candidate, all remain.
+    assert_eq!(filter(Canonical(2000), 2, 5, &any_parents), [2, 3, 4]);
+    assert_eq!(filter(Canonical(2000), 5, 5, &any_parents), [2, 3, 4]);
+    // Candidates whose parents don't match are excluded.
+    assert_eq!(filter(Canonical(3000), 1, 1, &any_parents), [6]);
+    assert_eq!(
+        filter(Canonical(3000), 1, 1, &|c: &GraftCandidate| c
+            .parents
+            .is_empty()),
+        []
+    );
+    assert_eq!(
+        filter(Canonical(2000), 5, 5, &|c: &GraftCandidate| c
+            .commit
+            .as_raw_bytes()[0]
+            != 3),
+        [2, 4]
+    );
+}
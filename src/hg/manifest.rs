@@ -92,14 +92,16 @@ impl ParseTree for RawHgManifest {
     type Inner = ManifestEntry;
     type Error = MalformedManifest;
 
-    fn parse_one_entry(buf: &mut &[u8]) -> Result<WithPath<Self::Inner>, Self::Error> {
+    fn parse_one_entry_borrowed<'a>(
+        buf: &mut &'a [u8],
+    ) -> Result<(&'a BStr, Self::Inner), Self::Error> {
         (|| {
             let [path, remainder] = buf.splitn_exact(b'\0')?;
             let fid = HgFileId::from_bytes(&remainder[..40]).ok()?;
             let [mode, remainder] = remainder[40..].splitn_exact(b'\n')?;
             *buf = remainder;
-            Some(WithPath::new(
-                path,
+            Some((
+                path.as_bstr(),
                 ManifestEntry {
                     fid,
                     attr: HgFileAttr::from_bytes(mode).ok()?,
@@ -109,11 +111,15 @@ impl ParseTree for RawHgManifest {
         .ok_or(MalformedManifest)
     }
 
-    fn write_one_entry<W: Write>(entry: &WithPath<Self::Inner>, mut w: W) -> io::Result<()> {
-        w.write_all(entry.path())?;
+    fn write_one_entry_borrowed<W: Write>(
+        path: &BStr,
+        inner: &Self::Inner,
+        mut w: W,
+    ) -> io::Result<()> {
+        w.write_all(path)?;
         w.write_all(b"\0")?;
-        write!(w, "{}", entry.inner().fid)?;
-        w.write_all(entry.inner().attr.as_bstr())?;
+        write!(w, "{}", inner.fid)?;
+        w.write_all(inner.attr.as_bstr())?;
         w.write_all(b"\n")?;
         Ok(())
     }
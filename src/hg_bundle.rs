@@ -8,11 +8,13 @@ use std::fmt::Display;
 use std::fs::File;
 use std::io::{self, copy, Chain, Cursor, ErrorKind, Read, Write};
 use std::iter::repeat;
-use std::mem;
 use std::os::raw::c_int;
+use std::path::Path;
 use std::ptr::{self, NonNull};
 use std::rc::Rc;
 use std::str::FromStr;
+use std::sync::{Condvar, Mutex};
+use std::{cmp, mem, thread};
 
 use bstr::{BStr, ByteSlice};
 use byteorder::{BigEndian, ByteOrder, ReadBytesExt, WriteBytesExt};
@@ -23,11 +25,12 @@ use flate2::read::ZlibDecoder;
 use flate2::write::ZlibEncoder;
 use indexmap::IndexMap;
 use itertools::Itertools;
+use once_cell::sync::Lazy;
 use tee::TeeReader;
+use tempfile::NamedTempFile;
 use zstd::stream::read::Decoder as ZstdDecoder;
 use zstd::stream::write::Encoder as ZstdEncoder;
 
-use crate::get_changes;
 use crate::git::{CommitId, RawCommit};
 use crate::hg::{HgChangesetId, HgFileId, HgManifestId, HgObjectId};
 use crate::hg_connect::{encodecaps, HgConnection, HgConnectionBase, HgRepo};
@@ -39,9 +42,13 @@ use crate::progress::Progress;
 use crate::store::{
     ChangesetHeads, RawGitChangesetMetadata, RawHgChangeset, RawHgFile, RawHgManifest, Store,
 };
+use crate::trace::Span;
 use crate::tree_util::{Empty, WithPath};
-use crate::util::{assert_ge, assert_lt, FromBytes, ImmutBString, ReadExt, SliceExt, ToBoxed};
-use crate::xdiff::textdiff;
+use crate::util::{
+    assert_ge, assert_lt, FromBytes, ImmutBString, RcSliceBuilder, ReadExt, SliceExt, ToBoxed,
+};
+use crate::xdiff::{blockdiff, textdiff, PatchInfo};
+use crate::{get_changes, get_typed_config};
 
 #[no_mangle]
 pub unsafe extern "C" fn rev_diff_start_iter(iterator: *mut strslice, chunk: *const rev_chunk) {
@@ -95,7 +102,7 @@ pub struct rev_diff_part<'a> {
 }
 
 pub struct RevChunk {
-    raw: ImmutBString,
+    raw: RcSliceBuilder<u8>,
     delta_node: Option<Rc<HgObjectId>>,
 }
 
@@ -146,17 +153,20 @@ impl From<RevChunk> for rev_chunk {
     }
 }
 
-pub fn read_rev_chunk<R: Read>(mut r: R) -> ImmutBString {
+// The returned buffer comes from, and returns to, the pool of recycled
+// allocations, so that reading chunks doesn't need a new allocation each.
+pub fn read_rev_chunk<R: Read>(mut r: R) -> RcSliceBuilder<u8> {
     let mut buf = [0; 4];
     r.read_exact(&mut buf).unwrap();
     let len = BigEndian::read_u32(&buf) as u64;
     if len == 0 {
-        return Box::new([]);
+        return RcSliceBuilder::new();
     }
-    let mut result = Vec::with_capacity(len.try_into().unwrap());
+    let len = len.checked_sub(4).unwrap();
+    let mut result = RcSliceBuilder::with_capacity(len.try_into().unwrap());
     // TODO: should error out on short read
-    copy(&mut r.take(len.checked_sub(4).unwrap()), &mut result).unwrap();
-    result.into_boxed_slice()
+    copy(&mut r.take(len), &mut result).unwrap();
+    result
 }
 
 pub fn read_bundle2_chunk<R: Read>(mut r: R) -> io::Result<ImmutBString> {
@@ -471,6 +481,7 @@ impl<'a> BundleReader<'a> {
                 reader,
                 version: self.version,
                 remaining: self.remaining.as_mut(),
+                span: Span::new("bundle", "changegroup"),
             })),
             BundleVersion::V2 => {
                 let header = read_bundle2_chunk(&mut *reader)?;
@@ -479,17 +490,220 @@ impl<'a> BundleReader<'a> {
                     return Ok(None);
                 }
                 self.remaining = Some(reader.read_u32::<BigEndian>()?);
+                let info = BundlePartInfo::read_from(&*header)?;
+                let span = Span::new("bundle", &*info.part_type);
                 Ok(Some(BundlePartReader {
-                    info: BundlePartInfo::read_from(&*header)?,
+                    info,
                     reader,
                     version: self.version,
                     remaining: self.remaining.as_mut(),
+                    span,
                 }))
             }
         }
     }
 }
 
+#[derive(Default)]
+struct SpoolState {
+    written: u64,
+    done: bool,
+    failed: bool,
+    error: Option<io::Error>,
+}
+
+#[derive(Default)]
+struct Spool {
+    state: Mutex<SpoolState>,
+    condvar: Condvar,
+}
+
+impl Spool {
+    fn fail(&self, e: io::Error) -> io::Error {
+        let mut state = self.state.lock().unwrap();
+        if !state.failed {
+            state.failed = true;
+            state.error = Some(io::Error::new(e.kind(), e.to_string()));
+        }
+        self.condvar.notify_all();
+        e
+    }
+
+    fn finish(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.done = true;
+        self.condvar.notify_all();
+    }
+}
+
+struct SpoolWriter<'a> {
+    file: File,
+    spool: &'a Spool,
+}
+
+impl Write for SpoolWriter<'_> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let n = self.file.write(buf).map_err(|e| self.spool.fail(e))?;
+        let mut state = self.spool.state.lock().unwrap();
+        state.written += n as u64;
+        self.spool.condvar.notify_all();
+        Ok(n)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.file.flush()
+    }
+}
+
+struct SpoolFailReader<'a, R: Read> {
+    reader: R,
+    spool: &'a Spool,
+}
+
+impl<R: Read> Read for SpoolFailReader<'_, R> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        self.reader.read(buf).map_err(|e| self.spool.fail(e))
+    }
+}
+
+struct SpoolReader<'a> {
+    file: File,
+    pos: u64,
+    spool: &'a Spool,
+}
+
+impl Read for SpoolReader<'_> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let mut state = self.spool.state.lock().unwrap();
+        loop {
+            if self.pos < state.written {
+                let len = cmp::min(buf.len() as u64, state.written - self.pos) as usize;
+                drop(state);
+                let n = self.file.read(&mut buf[..len])?;
+                self.pos += n as u64;
+                return Ok(n);
+            }
+            if state.failed {
+                return Err(state
+                    .error
+                    .take()
+                    .unwrap_or_else(|| io::Error::new(ErrorKind::Other, "Spooling failed")));
+            }
+            if state.done {
+                return Ok(0);
+            }
+            state = self.spool.condvar.wait(state).unwrap();
+        }
+    }
+}
+
+fn spool_bundle2(reader: impl Read, writer: &mut SpoolWriter) -> io::Result<()> {
+    let mut bundle = BundleReader::new(reader)?;
+    writer.write_all(b"HG20\0\0\0\0")?;
+    let mut buf = vec![0; 32768];
+    while let Some(mut part) = bundle.next_part()? {
+        let mut header = Vec::new();
+        part.write_into(&mut header)?;
+        write_bundle2_chunk(&mut *writer, &header)?;
+        loop {
+            let n = part.read(&mut buf)?;
+            if n == 0 {
+                break;
+            }
+            write_bundle2_chunk(&mut *writer, &buf[..n])?;
+        }
+        write_bundle2_chunk(&mut *writer, &[])?;
+    }
+    write_bundle2_chunk(&mut *writer, &[])
+}
+
+// Read the given bundle from a separate thread, as fast as it comes,
+// spooling it in a temporary file in `dir`, while `f` consumes it from the
+// temporary file as it is being written. This allows the network side not
+// to be held back by the consumer.
+// Only bundle2 is spooled, because the end of the stream can be found without
+// relying on the reader hitting EOF, which wouldn't happen with e.g. ssh.
+// Other bundles are given to `f` as is.
+pub fn with_spooled_bundle<T>(
+    dir: &Path,
+    mut reader: impl Read + Send,
+    f: impl FnOnce(&mut dyn Read) -> T,
+) -> io::Result<T> {
+    let mut header = [0; 4];
+    reader.read_exact(&mut header)?;
+    let mut reader = Cursor::new(header).chain(reader);
+    if &header != b"HG20" {
+        return Ok(f(&mut reader));
+    }
+    let file = NamedTempFile::new_in(dir)?;
+    let spool = Spool::default();
+    let mut spool_reader = SpoolReader {
+        file: file.reopen()?,
+        pos: 0,
+        spool: &spool,
+    };
+    let mut spool_writer = SpoolWriter {
+        file: file.reopen()?,
+        spool: &spool,
+    };
+    Ok(thread::scope(|s| {
+        thread::Builder::new()
+            .name("spool".into())
+            .spawn_scoped(s, || {
+                let reader = SpoolFailReader {
+                    reader,
+                    spool: &spool,
+                };
+                if let Err(e) = spool_bundle2(reader, &mut spool_writer) {
+                    spool.fail(e);
+                }
+                spool.finish();
+            })
+            .unwrap();
+        f(&mut spool_reader)
+    }))
+}
+
+#[test]
+fn test_spooled_bundle() {
+    let dir = tempfile::tempdir().unwrap();
+    let data = (0..100000u32).flat_map(u32::to_le_bytes).collect_vec();
+    let mut bundle = Vec::new();
+    {
+        let mut writer = BundleWriter::new(BundleSpec::V2None, &mut bundle).unwrap();
+        for (n, part_type) in ["foo", "bar"].into_iter().enumerate() {
+            let info = BundlePartInfo::new(n as u32, part_type).set_param("n", &n.to_string());
+            let mut part = writer.new_part(info).unwrap();
+            part.write_all(&data).unwrap();
+        }
+    }
+
+    let parts = with_spooled_bundle(dir.path(), Cursor::new(&bundle), |r| {
+        let mut reader = BundleReader::new(r).unwrap();
+        let mut parts = Vec::new();
+        while let Some(mut part) = reader.next_part().unwrap() {
+            let info = (
+                part.part_type.clone(),
+                part.get_param("n").unwrap().to_string(),
+            );
+            parts.push((info, part.read_all().unwrap()));
+        }
+        parts
+    })
+    .unwrap();
+    assert_eq!(parts.len(), 2);
+    assert_eq!(parts[0].0, ("foo".into(), "0".to_string()));
+    assert_eq!(parts[1].0, ("bar".into(), "1".to_string()));
+    assert!(parts.iter().all(|(_, d)| **d == *data));
+
+    let not_bundle2 = b"HG10UNfoo";
+    let result = with_spooled_bundle(dir.path(), Cursor::new(not_bundle2), |mut r| {
+        r.read_all().unwrap()
+    })
+    .unwrap();
+    assert_eq!(result.as_bstr(), not_bundle2.as_bstr());
+}
+
 #[derive(Debug, Eq, PartialEq)]
 pub struct BundlePartInfo {
     pub mandatory: bool,
@@ -603,10 +817,21 @@ pub struct BundlePartReader<'a> {
     reader: &'a mut dyn Read,
     version: BundleVersion,
     remaining: Option<&'a mut u32>,
+    // Covers the time between the part header being read and the reader
+    // being dropped, which includes processing the data.
+    span: Span,
 }
 
 impl Read for BundlePartReader<'_> {
     fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let read = self.read_(buf)?;
+        self.span.add("bytes", read as u64);
+        Ok(read)
+    }
+}
+
+impl BundlePartReader<'_> {
+    fn read_(&mut self, buf: &mut [u8]) -> io::Result<usize> {
         match self.version {
             BundleVersion::V1 => {
                 assert!(self.remaining.is_none());
@@ -848,6 +1073,10 @@ fn test_bundle_part_writer() {
 pub struct BundleConnection<R: Read> {
     reader: R,
     buf: Vec<u8>,
+    // When the whole bundle is available in memory (e.g. a memory mapped
+    // local file), it is read from there directly, and can be read several
+    // times without keeping a copy of what was read in `buf`.
+    mapped: Option<Box<dyn core::ops::Deref<Target = [u8]>>>,
     changesets: Option<ChangesetHeads>,
 }
 
@@ -856,6 +1085,7 @@ impl<R: Read> BundleConnection<R> {
         BundleConnection {
             reader,
             buf: Vec::new(),
+            mapped: None,
             changesets: None,
         }
     }
@@ -866,9 +1096,13 @@ impl<R: Read> BundleConnection<R> {
         }
         let mut changesets = ChangesetHeads::new();
         let mut raw_changesets = BTreeMap::new();
-        let tee = TeeReader::new(&mut self.reader, &mut self.buf);
 
-        let mut bundle = BundleReader::new(tee).unwrap();
+        let mut bundle = if let Some(mapped) = &self.mapped {
+            BundleReader::new(&mapped[..])
+        } else {
+            BundleReader::new(TeeReader::new(&mut self.reader, &mut self.buf))
+        }
+        .unwrap();
         while let Some(part) = bundle.next_part().unwrap() {
             if &*part.part_type != "changegroup" {
                 continue;
@@ -927,6 +1161,17 @@ impl<R: Read> BundleConnection<R> {
     }
 }
 
+impl BundleConnection<io::Empty> {
+    pub fn new_mapped(mapped: impl core::ops::Deref<Target = [u8]> + 'static) -> Self {
+        BundleConnection {
+            reader: io::empty(),
+            buf: Vec::new(),
+            mapped: Some(Box::new(mapped)),
+            changesets: None,
+        }
+    }
+}
+
 impl<R: Read> HgConnectionBase for BundleConnection<R> {
     fn get_capability(&self, name: &[u8]) -> Option<&bstr::BStr> {
         match name {
@@ -936,22 +1181,25 @@ impl<R: Read> HgConnectionBase for BundleConnection<R> {
     }
 }
 
-impl<R: Read> HgConnection for BundleConnection<R> {
+impl<R: Read + Send> HgConnection for BundleConnection<R> {
     fn getbundle<'a>(
         &'a mut self,
         _heads: &[HgChangesetId],
         common: &[HgChangesetId],
         _bundle2caps: Option<&str>,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString> {
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString> {
         assert!(common.is_empty());
 
+        if let Some(mapped) = &self.mapped {
+            return Ok(Box::new(&mapped[..]));
+        }
         Ok(Box::new(
             Cursor::new(mem::take(&mut self.buf)).chain(&mut self.reader),
         ))
     }
 }
 
-impl<R: Read> HgRepo for BundleConnection<R> {
+impl<R: Read + Send> HgRepo for BundleConnection<R> {
     fn branchmap(&mut self) -> ImmutBString {
         self.init_changesets();
         let mut branchmap = Vec::new();
@@ -998,8 +1246,33 @@ impl<R: Read> HgRepo for BundleConnection<R> {
 }
 
 pub fn create_chunk_data(a: &[u8], b: &[u8]) -> Box<[u8]> {
+    encode_chunk_data(textdiff(a, b))
+}
+
+// Files above this size are diffed with the block-based delta, because the
+// line-based diff gets too slow and memory hungry on them.
+static BLOCK_DIFF_THRESHOLD: Lazy<u64> =
+    Lazy::new(|| get_typed_config::<u64>("blockdiffthreshold").unwrap_or(16 << 20));
+
+// Same heuristic as git's buffer_is_binary.
+fn is_binary(buf: &[u8]) -> bool {
+    buf[..cmp::min(buf.len(), 8000)].contains(&b'\0')
+}
+
+/// Like `create_chunk_data`, but for file contents, which can be binary or
+/// huge, in which case a line-based diff is not worth it.
+pub fn create_file_chunk_data(a: &[u8], b: &[u8]) -> Box<[u8]> {
+    let threshold = *BLOCK_DIFF_THRESHOLD;
+    if is_binary(a) || is_binary(b) || a.len() as u64 > threshold || b.len() as u64 > threshold {
+        encode_chunk_data(blockdiff(a, b))
+    } else {
+        create_chunk_data(a, b)
+    }
+}
+
+fn encode_chunk_data<'a>(patches: impl Iterator<Item = PatchInfo<&'a [u8]>>) -> Box<[u8]> {
     let mut buf = Vec::new();
-    for patch in textdiff(a, b) {
+    for patch in patches {
         buf.write_u32::<BigEndian>(patch.start.try_into().unwrap())
             .unwrap();
         buf.write_u32::<BigEndian>(patch.end.try_into().unwrap())
@@ -1021,6 +1294,7 @@ fn write_chunk<T: core::ops::Deref<Target = [u8]>>(
     changeset: HgChangesetId,
     previous: &mut Option<(HgObjectId, T)>,
     always_previous: bool,
+    create_chunk_data: fn(&[u8], &[u8]) -> Box<[u8]>,
     mut f: impl FnMut(HgObjectId) -> T,
 ) -> io::Result<()> {
     let raw_object = f(node);
@@ -1110,6 +1384,7 @@ pub fn create_bundle(
             node,
             &mut previous,
             true,
+            create_chunk_data,
             |node| {
                 let node = HgChangesetId::from_unchecked(node);
                 RawHgChangeset::read(store, node.to_git(store).unwrap()).unwrap()
@@ -1177,6 +1452,7 @@ fn bundle_manifest<const CHUNK_SIZE: usize>(
             changeset,
             &mut previous,
             false,
+            create_chunk_data,
             |node| {
                 let node = HgManifestId::from_unchecked(node);
                 RawHgManifest::read(node.to_git(store).unwrap()).unwrap()
@@ -1264,6 +1540,7 @@ fn bundle_files<const CHUNK_SIZE: usize>(
                 changeset,
                 &mut previous,
                 false,
+                create_file_chunk_data,
                 |oid| RawHgFile::read_hg(store, HgFileId::from_unchecked(oid)).unwrap(),
             )
             .unwrap();
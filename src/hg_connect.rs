@@ -9,6 +9,7 @@ use std::ffi::{CStr, OsStr};
 use std::fs::File;
 use std::io::{stderr, BufReader, Read, Write};
 use std::str::FromStr;
+use std::sync::atomic::{AtomicBool, Ordering};
 use std::time::Instant;
 
 use bstr::{BStr, ByteSlice};
@@ -24,14 +25,15 @@ use crate::cinnabar::GitChangesetId;
 use crate::git::{CommitId, GitObjectId};
 use crate::graft::init_graft;
 use crate::hg::HgChangesetId;
-use crate::hg_bundle::{BundleConnection, BundleReader, BundleSpec};
+use crate::hg_bundle::{with_spooled_bundle, BundleConnection, BundleReader, BundleSpec};
 use crate::hg_connect_http::{get_http_connection, HttpRequest};
 use crate::hg_connect_stdio::get_stdio_connection;
 use crate::libgit::{
-    die, http_follow_config, remote, resolve_ref, rev_list, rev_list_with_parents,
+    die, git_common_dir, http_follow_config, remote, resolve_ref, rev_list, rev_list_with_parents,
 };
 use crate::oid::ObjectId;
 use crate::store::{has_metadata, merge_metadata, store_changegroup, Dag, Store};
+use crate::trace::Span;
 use crate::util::{
     DurationExt, FromBytes, ImmutBString, OsStrExt, PrefixWriter, SliceExt, ToBoxed,
 };
@@ -167,17 +169,33 @@ pub trait HgConnectionBase {
         100
     }
 
+    /// Maximum number of `known` queries of `sample_size` nodes that can be
+    /// sent in a single round-trip.
+    fn known_batch_limit(&self) -> usize {
+        1
+    }
+
     fn sync(&mut self) {}
 }
 
 pub trait HgWireConnection: HgConnectionBase {
     fn simple_command(&mut self, command: &str, args: HgArgs) -> ImmutBString;
 
+    // Send independent commands and return their responses, in order.
+    // Connections that can do so send all the commands without waiting for
+    // the responses in between.
+    fn simple_commands(&mut self, commands: Vec<(&str, HgArgs)>) -> Vec<ImmutBString> {
+        commands
+            .into_iter()
+            .map(|(command, args)| self.simple_command(command, args))
+            .collect()
+    }
+
     fn changegroup_command<'a>(
         &'a mut self,
         command: &str,
         args: HgArgs,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString>;
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString>;
 
     fn push_command(&mut self, input: File, command: &str, args: HgArgs) -> UnbundleResponse;
 }
@@ -188,7 +206,7 @@ pub trait HgConnection: HgConnectionBase {
         _heads: &[HgChangesetId],
         _common: &[HgChangesetId],
         _bundle2caps: Option<&str>,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString> {
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString> {
         unimplemented!();
     }
 
@@ -204,6 +222,10 @@ pub trait HgConnection: HgConnectionBase {
         unimplemented!();
     }
 
+    fn lookups(&mut self, keys: &[&str]) -> Vec<ImmutBString> {
+        keys.iter().map(|key| self.lookup(key)).collect()
+    }
+
     fn clonebundles(&mut self) -> ImmutBString {
         unimplemented!();
     }
@@ -219,7 +241,7 @@ impl<T: HgWireConnection> HgConnection for T {
         heads: &[HgChangesetId],
         common: &[HgChangesetId],
         bundle2caps: Option<&str>,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString> {
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString> {
         let mut args = Vec::new();
         args.push(OneHgArg {
             name: "heads",
@@ -271,6 +293,31 @@ impl<T: HgWireConnection> HgConnection for T {
         self.simple_command("lookup", args!(key: key))
     }
 
+    fn lookups(&mut self, keys: &[&str]) -> Vec<ImmutBString> {
+        let args = keys
+            .iter()
+            .map(|&key| {
+                [OneHgArg {
+                    name: "key",
+                    value: key.into(),
+                }]
+            })
+            .collect_vec();
+        self.simple_commands(
+            args.iter()
+                .map(|args| {
+                    (
+                        "lookup",
+                        HgArgs {
+                            args,
+                            extra_args: None,
+                        },
+                    )
+                })
+                .collect(),
+        )
+    }
+
     fn clonebundles(&mut self) -> ImmutBString {
         self.simple_command("clonebundles", args!())
     }
@@ -372,6 +419,10 @@ impl<C: HgWireConnection> HgConnectionBase for LogWireConnection<C> {
         self.conn.sample_size()
     }
 
+    fn known_batch_limit(&self) -> usize {
+        self.conn.known_batch_limit()
+    }
+
     fn sync(&mut self) {
         self.conn.sync();
     }
@@ -379,12 +430,14 @@ impl<C: HgWireConnection> HgConnectionBase for LogWireConnection<C> {
 
 impl<C: HgWireConnection> HgWireConnection for LogWireConnection<C> {
     fn simple_command(&mut self, command: &str, args: HgArgs) -> ImmutBString {
+        let mut span = Span::new("wire", command);
         let mut start = None;
         if self.logging_enabled {
             start = check_enabled(Checks::TIME).then(Instant::now);
             Self::log_command(command, &args);
         }
         let result = self.conn.simple_command(command, args);
+        span.add("bytes", result.len() as u64);
         if let Some(start) = start {
             Self::log(command, |_| {
                 format!("{} elapsed.", start.elapsed().fuzzy_display())
@@ -393,11 +446,37 @@ impl<C: HgWireConnection> HgWireConnection for LogWireConnection<C> {
         result
     }
 
+    fn simple_commands(&mut self, commands: Vec<(&str, HgArgs)>) -> Vec<ImmutBString> {
+        let mut start = None;
+        if self.logging_enabled {
+            start = check_enabled(Checks::TIME).then(Instant::now);
+            for (command, args) in &commands {
+                Self::log_command(command, args);
+            }
+        }
+        let mut span = Span::new("wire", "pipeline");
+        if span.is_enabled() {
+            span.set_text("commands", commands.iter().map(|(c, _)| *c).join(", "));
+        }
+        let names = start.map(|_| commands.iter().map(|(c, _)| *c).join(", "));
+        let result = self.conn.simple_commands(commands);
+        span.add("bytes", result.iter().map(|r| r.len() as u64).sum());
+        if let (Some(start), Some(names)) = (start, names) {
+            Self::log("pipeline", |_| {
+                format!("{} elapsed for {}.", start.elapsed().fuzzy_display(), names)
+            });
+        }
+        result
+    }
+
     fn changegroup_command<'a>(
         &'a mut self,
         command: &str,
         args: HgArgs,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString> {
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString> {
+        // This only covers sending the command. Reading the response is
+        // covered by the bundle reader.
+        let _span = Span::new("wire", command);
         if self.logging_enabled {
             Self::log_command(command, &args);
         }
@@ -405,6 +484,8 @@ impl<C: HgWireConnection> HgWireConnection for LogWireConnection<C> {
     }
 
     fn push_command(&mut self, input: File, command: &str, args: HgArgs) -> UnbundleResponse {
+        let mut span = Span::new("wire", command);
+        span.add("bytes", input.metadata().map_or(0, |m| m.len()));
         if self.logging_enabled {
             Self::log_command(command, &args);
         }
@@ -453,10 +534,18 @@ impl<C: HgWireConnection> HgWired<C> {
                 // Get bookmarks first because if we get them last and they have been
                 // updated after we got the heads, they may contain changesets we won't
                 // be pulling.
-                bookmarks = conn.simple_command("listkeys", args!(namespace: "bookmarks"));
+                // The commands are pipelined when the connection allows it.
+                let mut responses = conn
+                    .simple_commands(vec![
+                        ("listkeys", args!(namespace: "bookmarks")),
+                        ("branchmap", args!()),
+                        ("heads", args!()),
+                    ])
+                    .into_iter();
+                bookmarks = responses.next().unwrap();
                 loop {
-                    branchmap = conn.simple_command("branchmap", args!());
-                    heads = conn.simple_command("heads", args!());
+                    branchmap = responses.next().unwrap();
+                    heads = responses.next().unwrap();
                     // Some heads in the branchmap can be non-heads topologically, and
                     // won't appear in the heads list, but if the opposite happens, then
                     // the repo was updated between both calls and we need to try again
@@ -472,6 +561,9 @@ impl<C: HgWireConnection> HgWired<C> {
                     {
                         break;
                     }
+                    responses = conn
+                        .simple_commands(vec![("branchmap", args!()), ("heads", args!())])
+                        .into_iter();
                 }
             } else {
                 let out = conn.simple_command(
@@ -508,6 +600,14 @@ impl<C: HgWireConnection> HgConnectionBase for HgWired<C> {
         self.conn.sample_size()
     }
 
+    fn known_batch_limit(&self) -> usize {
+        if self.conn.get_capability(b"batch").is_some() {
+            self.conn.known_batch_limit()
+        } else {
+            1
+        }
+    }
+
     fn sync(&mut self) {
         self.conn.sync();
     }
@@ -519,7 +619,7 @@ impl<C: HgWireConnection> HgConnection for HgWired<C> {
         heads: &[HgChangesetId],
         common: &[HgChangesetId],
         bundle2caps: Option<&str>,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString> {
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString> {
         self.conn.getbundle(heads, common, bundle2caps)
     }
 
@@ -535,6 +635,10 @@ impl<C: HgWireConnection> HgConnection for HgWired<C> {
         self.conn.lookup(key)
     }
 
+    fn lookups(&mut self, keys: &[&str]) -> Vec<ImmutBString> {
+        self.conn.lookups(keys)
+    }
+
     fn clonebundles(&mut self) -> ImmutBString {
         self.conn.clonebundles()
     }
@@ -563,16 +667,97 @@ impl<C: HgWireConnection> HgRepo for HgWired<C> {
     }
 
     fn known(&mut self, nodes: &[HgChangesetId]) -> Box<[bool]> {
-        self.conn
-            .simple_command(
-                "known",
-                args!(
-                    nodes: nodes,
-                    *: &[]
-                ),
-            )
+        let sample_size = self.sample_size();
+        let batch_limit = self.known_batch_limit();
+        if nodes.len() <= sample_size {
+            return self
+                .conn
+                .simple_command(
+                    "known",
+                    args!(
+                        nodes: nodes,
+                        *: &[]
+                    ),
+                )
+                .iter()
+                .map(|b| *b == b'1')
+                .collect_vec()
+                .into();
+        }
+        if batch_limit < 2 {
+            // Without `batch`, still send queries of at most `sample_size`
+            // nodes, because servers reject overly large requests (over HTTP,
+            // the arguments may end up in headers). They are pipelined when
+            // the connection allows it.
+            let args = nodes
+                .chunks(sample_size)
+                .map(|chunk| {
+                    [OneHgArg {
+                        name: "nodes",
+                        value: chunk.into(),
+                    }]
+                })
+                .collect_vec();
+            return self
+                .conn
+                .simple_commands(
+                    args.iter()
+                        .map(|args| {
+                            (
+                                "known",
+                                HgArgs {
+                                    args,
+                                    extra_args: Some(&[]),
+                                },
+                            )
+                        })
+                        .collect(),
+                )
+                .iter()
+                .flat_map(|response| response.iter().map(|b| *b == b'1'))
+                .collect_vec()
+                .into();
+        }
+        // Send groups of `known` queries of at most `sample_size` nodes each
+        // through `batch`, so that large samples don't need as many
+        // round-trips. The `batch` commands themselves are pipelined when the
+        // connection allows it.
+        let cmds = nodes
+            .chunks(sample_size * batch_limit)
+            .map(|group| {
+                group
+                    .chunks(sample_size)
+                    .map(|chunk| format!("known nodes={}", chunk.iter().join(" ")))
+                    .join(";")
+            })
+            .collect_vec();
+        let args = cmds
             .iter()
-            .map(|b| *b == b'1')
+            .map(|cmds| {
+                [OneHgArg {
+                    name: "cmds",
+                    value: cmds.into(),
+                }]
+            })
+            .collect_vec();
+        let responses = self.conn.simple_commands(
+            args.iter()
+                .map(|args| {
+                    (
+                        "batch",
+                        HgArgs {
+                            args,
+                            extra_args: Some(&[]),
+                        },
+                    )
+                })
+                .collect(),
+        );
+        responses
+            .iter()
+            .flat_map(|out| out.split(|&b| b == b';'))
+            .flat_map(|part| unescape_batched_output(part).into_vec())
+            .map(|b| b == b'1')
             .collect_vec()
             .into()
     }
@@ -774,6 +959,14 @@ fn test_encode_decode_caps() {
     );
 }
 
+static SPOOL_BUNDLES: AtomicBool = AtomicBool::new(false);
+
+// When enabled, bundles received from the network are spooled to disk as
+// fast as they are received, while they are being imported.
+pub fn set_spool_bundles(enable: bool) {
+    SPOOL_BUNDLES.store(enable, Ordering::Relaxed);
+}
+
 pub fn get_store_bundle(
     store: &Store,
     conn: &mut dyn HgRepo,
@@ -793,23 +986,32 @@ pub fn get_store_bundle(
     };
     conn.getbundle(heads, common, bundle2caps.as_deref())
         .and_then(|r| {
-            let mut bundle = BundleReader::new(r).unwrap();
-            while let Some(part) = bundle.next_part().unwrap() {
-                if &*part.part_type == "changegroup" {
-                    let version = part
-                        .get_param("version")
-                        .map_or(1, |v| u8::from_str(v).unwrap());
-                    store_changegroup(store, BufReader::new(part), version);
-                } else if &*part.part_type == "stream2" {
-                    return Err(b"Stream bundles are not supported."
-                        .to_vec()
-                        .into_boxed_slice());
-                }
+            if SPOOL_BUNDLES.load(Ordering::Relaxed) {
+                with_spooled_bundle(&git_common_dir(), r, |r| store_bundle(store, r))
+                    .map_err(|e| e.to_string().into_bytes().into_boxed_slice())?
+            } else {
+                store_bundle(store, r)
             }
-            Ok(())
         })
 }
 
+fn store_bundle(store: &Store, r: impl Read) -> Result<(), ImmutBString> {
+    let mut bundle = BundleReader::new(r).unwrap();
+    while let Some(part) = bundle.next_part().unwrap() {
+        if &*part.part_type == "changegroup" {
+            let version = part
+                .get_param("version")
+                .map_or(1, |v| u8::from_str(v).unwrap());
+            store_changegroup(store, BufReader::new(part), version);
+        } else if &*part.part_type == "stream2" {
+            return Err(b"Stream bundles are not supported."
+                .to_vec()
+                .into_boxed_slice());
+        }
+    }
+    Ok(())
+}
+
 #[derive(Default, Debug)]
 struct FindCommonInfo {
     hg_node: Cell<Option<HgChangesetId>>,
@@ -827,7 +1029,8 @@ pub fn find_common(
     if hgheads.is_empty() {
         return vec![];
     }
-    let sample_size = conn.sample_size();
+    let mut sample_size = conn.sample_size();
+    let max_sample_size = sample_size * conn.known_batch_limit();
 
     let mut undetermined = Vec::new();
     let mut undetermined_set = HashSet::new();
@@ -1003,6 +1206,13 @@ pub fn find_common(
                 }
             });
 
+        // Like mercurial's setdiscovery, grow the sample while the answers
+        // are uniform, as they don't tell much about where the boundary
+        // between known and unknown changesets lies.
+        if known.is_empty() || unknown.is_empty() {
+            sample_size = std::cmp::min(sample_size * 2, max_sample_size);
+        }
+
         dag.traverse_parents(&known, is_undetermined)
             .for_each(|(_, data)| {
                 if data.known.get().is_none() {
@@ -46,6 +46,7 @@ use crate::libgit::{
     run_one_slot, slot_results, ssl_cainfo, HTTP_OK, HTTP_REAUTH,
 };
 use crate::logging::{self, LoggingReader, LoggingWriter};
+use crate::trace::Span;
 use crate::util::{
     ExactSizeReadRewind, ImmutBString, OsStrExt, PrefixWriter, ReadExt, SliceExt, ToBoxed,
 };
@@ -277,6 +278,7 @@ struct HttpThreadData {
     curl: *mut CURL,
     first: bool,
     logger: Option<LoggingWriter<'static, std::io::Sink>>,
+    trace: Span,
 }
 
 unsafe extern "C" fn trace_log_callback(
@@ -364,6 +366,13 @@ impl HttpRequest {
                         writer.set_direction(logging::Direction::Receive);
                         writer
                     }),
+                    trace: {
+                        let mut span = Span::new("http", "http request");
+                        // Only the query part, the rest of the url may
+                        // contain credentials.
+                        span.set_text("query", self.url.query().unwrap_or(""));
+                        span
+                    },
                 };
                 curl_easy_setopt(slot.curl, CURLOPT_FILE, &mut data);
                 curl_easy_setopt(
@@ -651,6 +660,7 @@ unsafe extern "C" fn http_request_execute(
     if let Some(logger) = &mut data.logger {
         logger.write_all(buf).unwrap();
     }
+    data.trace.add("bytes", buf.len() as u64);
     if data.sender.send(Either::Right(buf.to_boxed())).is_err() {
         return 0;
     }
@@ -754,7 +764,7 @@ impl HgWireConnection for HgHttpConnection {
         &'a mut self,
         command: &str,
         args: HgArgs,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString> {
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString> {
         let mut http_req = self.start_command_request(command, args);
         if let Some(media_type) = self
             .get_capability(b"httpmediatype")
@@ -775,7 +785,7 @@ impl HgWireConnection for HgHttpConnection {
             Some("application/mercurial-0.2") => {
                 let comp_len = http_resp.read_u8().unwrap() as u64;
                 let comp = (&mut http_resp).take(comp_len).read_all().unwrap();
-                let reader: Box<dyn Read> = match &comp[..] {
+                let reader: Box<dyn Read + Send> = match &comp[..] {
                     b"zstd" => Box::new(ZstdDecoder::new(http_resp).unwrap()),
                     b"zlib" => Box::new(ZlibDecoder::new(http_resp)),
                     b"none" => Box::new(http_resp),
@@ -834,6 +844,16 @@ impl HgConnectionBase for HgHttpConnection {
             100
         }
     }
+
+    fn known_batch_limit(&self) -> usize {
+        // Without httppostargs, arguments go in headers, which can't grow
+        // arbitrarily.
+        if self.capabilities.get_capability(b"httppostargs").is_some() {
+            8
+        } else {
+            1
+        }
+    }
 }
 
 impl Drop for HgHttpConnection {
@@ -34,9 +34,12 @@ use crate::hg_connect::{
     UnbundleResponse,
 };
 use crate::libc::FdFile;
+#[cfg(unix)]
+use crate::libc::MappedFile;
 use crate::libcinnabar::hg_connect_prepare_command;
 use crate::libgit::local_repo_env;
 use crate::logging::{LoggingReader, LoggingWriter};
+use crate::trace::Span;
 use crate::util::{CStrExt, ImmutBString, OsStrExt, PrefixWriter, ReadExt};
 
 pub struct HgStdioConnection {
@@ -93,6 +96,11 @@ fn stdio_command_add_param(data: &mut BString, name: &str, value: &str) {
 }
 
 fn stdio_send_command(conn: &mut HgStdioConnection, command: &str, args: HgArgs) {
+    let data = stdio_command_data(command, args);
+    stdio_write_command(conn.proc_in.as_mut().unwrap(), command, &data);
+}
+
+fn stdio_command_data(command: &str, args: HgArgs) -> BString {
     let mut data = BString::from(Vec::<u8>::new());
     data.extend(command.as_bytes());
     data.push(b'\n');
@@ -105,21 +113,24 @@ fn stdio_send_command(conn: &mut HgStdioConnection, command: &str, args: HgArgs)
             stdio_command_add_param(&mut data, name, &value.as_string());
         }
     }
+    data
+}
+
+fn stdio_write_command(proc_in: &mut ChildStdin, command: &str, data: &[u8]) {
     let target = if command.is_empty() {
         Cow::Borrowed("raw-wire")
     } else {
         format!("raw-wire::{command}").into()
     };
-    LoggingWriter::new_hex(target, log::Level::Trace, conn.proc_in.as_mut().unwrap())
-        .write_all(&data)
+    LoggingWriter::new_hex(target, log::Level::Trace, proc_in)
+        .write_all(data)
         .unwrap();
 }
 
-fn stdio_read_response(conn: &mut HgStdioConnection, command: &str) -> ImmutBString {
+fn stdio_read_response(proc_out: &mut BufReader<ChildStdout>, command: &str) -> ImmutBString {
     let mut length_str = String::new();
     let target = format!("raw-wire::{command}");
-    let mut input =
-        LoggingReader::new_hex(&target, log::Level::Trace, conn.proc_out.as_mut().unwrap());
+    let mut input = LoggingReader::new_hex(&target, log::Level::Trace, proc_out);
     input.read_line(&mut length_str).unwrap();
     let length = usize::from_str(length_str.trim_end_matches('\n')).unwrap();
     input.read_exactly(length).unwrap()
@@ -128,14 +139,47 @@ fn stdio_read_response(conn: &mut HgStdioConnection, command: &str) -> ImmutBStr
 impl HgWireConnection for HgStdioConnection {
     fn simple_command(&mut self, command: &str, args: HgArgs) -> ImmutBString {
         stdio_send_command(self, command, args);
-        stdio_read_response(self, command)
+        stdio_read_response(self.proc_out.as_mut().unwrap(), command)
+    }
+
+    fn simple_commands(&mut self, commands: Vec<(&str, HgArgs)>) -> Vec<ImmutBString> {
+        if commands.len() < 2 {
+            return commands
+                .into_iter()
+                .map(|(command, args)| self.simple_command(command, args))
+                .collect();
+        }
+        let requests = commands
+            .into_iter()
+            .map(|(command, args)| (command, stdio_command_data(command, args)))
+            .collect_vec();
+        let requests = &requests;
+        let proc_in = self.proc_in.as_mut().unwrap();
+        let proc_out = self.proc_out.as_mut().unwrap();
+        // Send the commands from a separate thread while reading the
+        // responses, so that neither we nor the server block on a full pipe
+        // while the other side is itself blocked writing.
+        thread::scope(|s| {
+            thread::Builder::new()
+                .name("pipeline".into())
+                .spawn_scoped(s, move || {
+                    for (command, data) in requests {
+                        stdio_write_command(proc_in, command, data);
+                    }
+                })
+                .unwrap();
+            requests
+                .iter()
+                .map(|(command, _)| stdio_read_response(proc_out, command))
+                .collect()
+        })
     }
 
     fn changegroup_command<'a>(
         &'a mut self,
         command: &str,
         args: HgArgs,
-    ) -> Result<Box<dyn Read + 'a>, ImmutBString> {
+    ) -> Result<Box<dyn Read + Send + 'a>, ImmutBString> {
         stdio_send_command(self, command, args);
 
         /* We assume the caller is only going to read the right amount of data according
@@ -159,7 +203,7 @@ impl HgWireConnection for HgStdioConnection {
          * it's sent if not, it's an error (typically, the remote will
          * complain here if there was a lost push race). */
         //TODO: handle that error.
-        let header = stdio_read_response(self, command);
+        let header = stdio_read_response(self.proc_out.as_mut().unwrap(), command);
         let target = format!("raw-wire::{command}");
         let mut proc_in =
             LoggingWriter::new_hex(&target, log::Level::Trace, self.proc_in.as_mut().unwrap());
@@ -195,8 +239,14 @@ impl HgWireConnection for HgStdioConnection {
         } else {
             /* There are two responses, one for output, one for actual response. */
             //TODO: actually handle output here
-            drop(stdio_read_response(self, command));
-            UnbundleResponse::Raw(stdio_read_response(self, command))
+            drop(stdio_read_response(
+                self.proc_out.as_mut().unwrap(),
+                command,
+            ));
+            UnbundleResponse::Raw(stdio_read_response(
+                self.proc_out.as_mut().unwrap(),
+                command,
+            ))
         }
     }
 }
@@ -214,7 +264,12 @@ impl HgConnectionBase for HgStdioConnection {
         10000
     }
 
+    fn known_batch_limit(&self) -> usize {
+        8
+    }
+
     fn sync(&mut self) {
+        let _span = Span::new("wire", "wait for remote stderr");
         let guard = self.synchronizer.read_finished.lock().unwrap();
         if !*guard {
             self.synchronizer.waker.wake().unwrap();
@@ -255,6 +310,11 @@ pub fn get_stdio_connection(url: &Url, flags: c_int) -> Option<Box<dyn HgRepo>>
     } else {
         let path = url.to_file_path().unwrap();
         if path.metadata().map(|m| m.is_file()).unwrap_or(false) {
+            #[cfg(unix)]
+            return Some(Box::new(BundleConnection::new_mapped(
+                MappedFile::open(path).unwrap(),
+            )));
+            #[cfg(windows)]
             return Some(Box::new(BundleConnection::new(File::open(path).unwrap())));
         }
         path.as_os_str().as_bytes().to_owned()
@@ -392,6 +452,8 @@ pub fn get_stdio_connection(url: &Url, flags: c_int) -> Option<Box<dyn HgRepo>>
                                         .unwrap();
                                     continue;
                                 }
+                                let mut span = Span::new("wire", "remote stderr");
+                                span.add("bytes", buf.len() as u64);
                                 writer.write_all(buf).unwrap();
                             }
                             WAKER => {
@@ -425,11 +487,11 @@ pub fn get_stdio_connection(url: &Url, flags: c_int) -> Option<Box<dyn HgRepo>>
         ),
     );
 
-    let buf = stdio_read_response(&mut conn, "capabilities");
+    let buf = stdio_read_response(conn.proc_out.as_mut().unwrap(), "capabilities");
     if *buf != b"\n"[..] {
         mem::swap(&mut conn.capabilities, &mut HgCapabilities::new_from(&buf));
         /* Now read the response for the "between" command. */
-        stdio_read_response(&mut conn, "between");
+        stdio_read_response(conn.proc_out.as_mut().unwrap(), "between");
     }
 
     Some(Box::new(HgWired::new(conn)))
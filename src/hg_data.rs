@@ -3,7 +3,9 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 use std::borrow::Cow;
+use std::collections::BTreeMap;
 use std::io::Write;
+use std::sync::Mutex;
 
 use bstr::{BStr, ByteSlice};
 use derive_more::Debug;
@@ -444,13 +446,34 @@ pub fn hash_data(
     hash.finalize()
 }
 
+fn normalized_parents(parent1: Option<HgFileId>, parent2: Option<HgFileId>) -> [HgFileId; 2] {
+    let mut parents = [
+        parent1.unwrap_or(HgFileId::NULL),
+        parent2.unwrap_or(HgFileId::NULL),
+    ];
+    parents.sort();
+    parents
+}
+
+// Parents of file nodes we created ourselves (e.g. during push), which are
+// about to be looked up again by find_file_parents when bundling. Entries
+// are consumed on lookup.
+static KNOWN_FILE_PARENTS: Mutex<BTreeMap<HgFileId, [HgFileId; 2]>> = Mutex::new(BTreeMap::new());
+
+pub fn record_file_parents(node: HgFileId, parent1: Option<HgFileId>, parent2: Option<HgFileId>) {
+    KNOWN_FILE_PARENTS
+        .lock()
+        .unwrap()
+        .insert(node, normalized_parents(parent1, parent2));
+}
+
 pub fn find_file_parents(
     node: HgFileId,
     parent1: Option<HgFileId>,
     parent2: Option<HgFileId>,
     data: &[u8],
 ) -> Option<[Option<HgFileId>; 2]> {
-    for [parent1, parent2] in [
+    let candidates = [
         [parent1, parent2],
         // In some cases, only one parent is stored in a merge, because
         // the other parent is actually an ancestor of the first one, but
@@ -465,10 +488,71 @@ pub fn find_file_parents(
         [parent2, parent2],
         // As last resord, try without any parents.
         [None, None],
-    ] {
+    ];
+    if let Some(known) = KNOWN_FILE_PARENTS.lock().unwrap().remove(&node) {
+        if let Some(&result) = candidates
+            .iter()
+            .find(|[p1, p2]| normalized_parents(*p1, *p2) == known)
+        {
+            return Some(result);
+        }
+    }
+    // Many of the candidates end up hashing the same thing (e.g. when one
+    // of the parents is null, or both are the same), so only hash each
+    // distinct set of parents once. Hashing is the expensive part for
+    // large files.
+    let mut tried = Vec::with_capacity(candidates.len());
+    for [parent1, parent2] in candidates {
+        let parents = normalized_parents(parent1, parent2);
+        if tried.contains(&parents) {
+            continue;
+        }
+        tried.push(parents);
         if hash_data(parent1.map(Into::into), parent2.map(Into::into), data) == node {
             return Some([parent1, parent2]);
         }
     }
     None
 }
+
+#[test]
+fn test_find_file_parents() {
+    let p1 = HgFileId::from_unchecked(hash_data(None, None, b"foo"));
+    let p2 = HgFileId::from_unchecked(hash_data(None, None, b"bar"));
+    let data = b"qux";
+    let node = |parent1: Option<HgFileId>, parent2: Option<HgFileId>| {
+        HgFileId::from_unchecked(hash_data(
+            parent1.map(Into::into),
+            parent2.map(Into::into),
+            data,
+        ))
+    };
+
+    for (expected, input) in [
+        ([Some(p1), Some(p2)], [Some(p1), Some(p2)]),
+        ([Some(p2), Some(p1)], [Some(p2), Some(p1)]),
+        ([Some(p1), None], [Some(p1), Some(p2)]),
+        ([Some(p2), None], [Some(p1), Some(p2)]),
+        ([Some(p1), Some(p1)], [Some(p1), Some(p2)]),
+        ([Some(p2), Some(p2)], [Some(p1), Some(p2)]),
+        ([None, None], [Some(p1), Some(p2)]),
+        (
+            [Some(p1), Some(HgFileId::NULL)],
+            [Some(p1), Some(HgFileId::NULL)],
+        ),
+    ] {
+        let n = node(expected[0], expected[1]);
+        assert_eq!(
+            find_file_parents(n, input[0], input[1], data),
+            Some(expected)
+        );
+        record_file_parents(n, expected[0], expected[1]);
+        assert_eq!(
+            find_file_parents(n, input[0], input[1], data),
+            Some(expected)
+        );
+    }
+
+    let unrelated = HgFileId::from_unchecked(hash_data(None, None, b"unrelated"));
+    assert_eq!(find_file_parents(unrelated, Some(p1), Some(p2), data), None);
+}
@@ -3,8 +3,20 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 use std::ffi::c_void;
+#[cfg(unix)]
+use std::fs::File;
 use std::io::{self, Read, Write};
+#[cfg(unix)]
+use std::mem;
+#[cfg(unix)]
+use std::ops::Deref;
+#[cfg(unix)]
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
 use std::os::raw::c_int;
+#[cfg(unix)]
+use std::path::Path;
+#[cfg(unix)]
+use std::ptr::{self, NonNull};
 
 pub struct FdFile(c_int);
 
@@ -45,3 +57,148 @@ impl Write for FdFile {
         Ok(())
     }
 }
+
+// Read-only memory mapping of a whole file.
+#[cfg(unix)]
+pub struct MappedFile {
+    ptr: NonNull<u8>,
+    len: usize,
+}
+
+#[cfg(unix)]
+impl MappedFile {
+    pub fn open(path: impl AsRef<Path>) -> io::Result<Self> {
+        let file = File::open(path)?;
+        let len = usize::try_from(file.metadata()?.len())
+            .map_err(|e| io::Error::new(io::ErrorKind::Other, e))?;
+        if len == 0 {
+            // mmap doesn't support empty mappings.
+            return Ok(MappedFile {
+                ptr: NonNull::dangling(),
+                len,
+            });
+        }
+        unsafe {
+            let ptr = ::libc::mmap(
+                ptr::null_mut(),
+                len,
+                ::libc::PROT_READ,
+                ::libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            );
+            if ptr == ::libc::MAP_FAILED {
+                return Err(io::Error::last_os_error());
+            }
+            // The file is expected to be read from start to end, so let the
+            // kernel read ahead aggressively. This is only a hint, so errors
+            // don't matter.
+            ::libc::madvise(ptr, len, ::libc::MADV_SEQUENTIAL);
+            Ok(MappedFile {
+                ptr: NonNull::new_unchecked(ptr.cast()),
+                len,
+            })
+        }
+    }
+}
+
+#[cfg(unix)]
+impl Deref for MappedFile {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+#[cfg(unix)]
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        if self.len > 0 {
+            unsafe {
+                ::libc::munmap(self.ptr.as_ptr().cast(), self.len);
+            }
+        }
+    }
+}
+
+// Send `data` over a unix socket, along with the given file descriptors.
+#[cfg(unix)]
+pub fn send_with_fds(sock: &impl AsRawFd, data: &[u8], fds: &[c_int]) -> io::Result<()> {
+    unsafe {
+        let fds_len = mem::size_of_val(fds) as u32;
+        // u64 keeps the control buffer aligned for cmsghdr.
+        let mut control = vec![0u64; (::libc::CMSG_SPACE(fds_len) as usize + 7) / 8];
+        let mut iov = ::libc::iovec {
+            iov_base: data.as_ptr() as *mut c_void,
+            iov_len: data.len(),
+        };
+        let mut msg: ::libc::msghdr = mem::zeroed();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.as_mut_ptr().cast();
+        msg.msg_controllen = mem::size_of_val(&control[..]) as _;
+        let cmsg = ::libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = ::libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = ::libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = ::libc::CMSG_LEN(fds_len) as _;
+        ptr::copy_nonoverlapping(fds.as_ptr(), ::libc::CMSG_DATA(cmsg).cast(), fds.len());
+        match ::libc::sendmsg(sock.as_raw_fd(), &msg, 0) {
+            n if n < 0 => Err(io::Error::last_os_error()),
+            n if n as usize != data.len() => {
+                Err(io::Error::new(io::ErrorKind::WriteZero, "short write"))
+            }
+            _ => Ok(()),
+        }
+    }
+}
+
+// Receive data from a unix socket into `buf`, along with up to `max_fds`
+// file descriptors.
+#[cfg(unix)]
+pub fn recv_with_fds(
+    sock: &impl AsRawFd,
+    buf: &mut [u8],
+    max_fds: usize,
+) -> io::Result<(usize, Vec<OwnedFd>)> {
+    unsafe {
+        let fds_len = (max_fds * mem::size_of::<c_int>()) as u32;
+        let mut control = vec![0u64; (::libc::CMSG_SPACE(fds_len) as usize + 7) / 8];
+        let mut iov = ::libc::iovec {
+            iov_base: buf.as_mut_ptr().cast(),
+            iov_len: buf.len(),
+        };
+        let mut msg: ::libc::msghdr = mem::zeroed();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.as_mut_ptr().cast();
+        msg.msg_controllen = mem::size_of_val(&control[..]) as _;
+        let n = ::libc::recvmsg(sock.as_raw_fd(), &mut msg, 0);
+        if n < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let mut fds = Vec::new();
+        let mut cmsg = ::libc::CMSG_FIRSTHDR(&msg);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_level == ::libc::SOL_SOCKET && (*cmsg).cmsg_type == ::libc::SCM_RIGHTS {
+                let data = ::libc::CMSG_DATA(cmsg) as *const c_int;
+                let count = ((*cmsg).cmsg_len as usize - ::libc::CMSG_LEN(0) as usize)
+                    / mem::size_of::<c_int>();
+                fds.extend((0..count).map(|i| {
+                    let fd = ptr::read_unaligned(data.add(i));
+                    // Don't leak the descriptors to processes we spawn.
+                    ::libc::fcntl(fd, ::libc::F_SETFD, ::libc::FD_CLOEXEC);
+                    OwnedFd::from_raw_fd(fd)
+                }));
+            }
+            cmsg = ::libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+        if msg.msg_flags & ::libc::MSG_CTRUNC != 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "too many file descriptors",
+            ));
+        }
+        Ok((n as usize, fds))
+    }
+}
@@ -15,6 +15,7 @@ use crate::libgit::{
 };
 use crate::oid::{Abbrev, ObjectId};
 use crate::store::{store_git_commit, Store};
+use crate::trace::Span;
 
 #[allow(non_camel_case_types)]
 #[derive(Clone, Debug)]
@@ -237,6 +238,7 @@ pub fn store_metadata_notes(
     let mut result = CommitId::NULL;
     let mut tree = object_id::default();
     if notes.current.dirty() || notes.additions.dirty() {
+        let _span = Span::new("import", "write notes tree");
         unsafe {
             cinnabar_write_notes_tree(notes, &mut tree, u16::from(mode).into());
         }
@@ -8,9 +8,10 @@ use std::marker::PhantomData;
 use std::mem;
 use std::ops::{Deref, DerefMut};
 use std::os::raw::{c_char, c_int, c_long, c_uint, c_ulong, c_ushort};
+use std::path::{Path, PathBuf};
 use std::ptr::{self, NonNull};
 use std::str::FromStr;
-use std::sync::RwLock;
+use std::sync::{Mutex, RwLock};
 use std::time::{Duration, Instant};
 
 use bstr::ByteSlice;
@@ -201,8 +202,17 @@ pub struct repository {
     commondir: *const c_char,
 }
 
+pub fn git_dir() -> PathBuf {
+    unsafe { Path::new(CStr::from_ptr((*the_repository).gitdir).to_osstr()).to_path_buf() }
+}
+
+pub fn git_common_dir() -> PathBuf {
+    unsafe { Path::new(CStr::from_ptr((*the_repository).commondir).to_osstr()).to_path_buf() }
+}
+
 #[allow(dead_code, non_camel_case_types, clippy::upper_case_acronyms)]
 #[repr(C)]
+#[derive(Clone, Copy, PartialEq, Eq)]
 pub enum object_type {
     OBJ_BAD = -1,
     OBJ_NONE = 0,
@@ -366,6 +376,44 @@ extern "C" {
     ) -> c_int;
 
     fn repo_lookup_replace_object(r: *mut repository, oid: *const object_id) -> *const object_id;
+
+    pub fn reprepare_packed_git(r: *mut repository);
+
+    fn enable_obj_read_lock();
+
+    fn disable_obj_read_lock();
+}
+
+static OBJ_READ_LOCK_USERS: Mutex<usize> = Mutex::new(0);
+
+/// Keeps git's object read lock enabled, which makes object reading
+/// thread-safe, for as long as it's alive. git doesn't support nesting
+/// enable_obj_read_lock, so the guards are counted.
+pub struct ObjReadLock(());
+
+impl ObjReadLock {
+    pub fn new() -> Self {
+        let mut users = OBJ_READ_LOCK_USERS.lock().unwrap();
+        if *users == 0 {
+            unsafe {
+                enable_obj_read_lock();
+            }
+        }
+        *users += 1;
+        ObjReadLock(())
+    }
+}
+
+impl Drop for ObjReadLock {
+    fn drop(&mut self) {
+        let mut users = OBJ_READ_LOCK_USERS.lock().unwrap();
+        *users -= 1;
+        if *users == 0 {
+            unsafe {
+                disable_obj_read_lock();
+            }
+        }
+    }
 }
 
 pub fn get_oid_committish(s: &[u8]) -> Option<CommitId> {
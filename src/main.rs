@@ -43,6 +43,8 @@
 extern crate log;
 
 mod cinnabar;
+#[cfg(unix)]
+mod daemon;
 mod git;
 mod graft;
 mod hg;
@@ -53,6 +55,7 @@ mod logging;
 mod oid;
 mod progress;
 pub mod store;
+mod trace;
 pub mod tree_util;
 mod util;
 mod version;
@@ -65,25 +68,27 @@ pub(crate) mod hg_connect_stdio;
 pub(crate) mod hg_data;
 
 use std::borrow::{Borrow, Cow};
-use std::cell::{Cell, OnceCell, RefCell};
+use std::cell::{Cell, RefCell};
 use std::cmp::Ordering;
 use std::collections::{BTreeMap, BTreeSet, HashMap, HashSet};
 use std::ffi::{CStr, CString, OsStr, OsString};
 use std::fs::File;
 use std::hash::Hash;
 use std::io::{stderr, stdin, stdout, BufRead, BufReader, BufWriter, IsTerminal, Write};
-use std::iter::repeat;
+use std::iter::{self, repeat};
+use std::num::NonZeroUsize;
 use std::os::raw::{c_char, c_int};
 #[cfg(windows)]
 use std::os::windows::ffi::OsStrExt as WinOsStrExt;
 use std::path::{Path, PathBuf};
-use std::process::Command;
+use std::process::{Command, Stdio};
 use std::str::{self, from_utf8, FromStr};
+use std::sync::atomic::{AtomicUsize, Ordering as AtomicOrdering};
 use std::sync::Mutex;
 #[cfg(feature = "version-check")]
 use std::time::Duration;
 use std::time::Instant;
-use std::{cmp, fmt};
+use std::{cmp, fmt, mem, thread};
 
 use bitflags::bitflags;
 use bstr::io::BufReadExt;
@@ -103,16 +108,17 @@ use hg::{HgChangesetId, HgFileId, HgManifestId, ManifestEntry};
 use hg_bundle::{create_bundle, create_chunk_data, read_rev_chunk, BundleSpec, RevChunkIter};
 use hg_connect::{
     get_bundle, get_bundle_connection, get_clonebundle_url, get_connection, get_store_bundle,
-    HgConnection, HgConnectionBase, HgRepo,
+    set_spool_bundles, HgConnection, HgConnectionBase, HgRepo,
 };
+use hg_data::record_file_parents;
 use itertools::EitherOrBoth::{Both, Left, Right};
 use itertools::{EitherOrBoth, Itertools};
 use libgit::{
     commit, config_get_value, die, diff_tree_with_copies, for_each_ref_in, for_each_remote,
     get_oid_committish, get_unique_abbrev, git_author_info, git_committer_info, lookup_commit,
-    lookup_replace_commit, object_id, reachable_subset, remote, repository, resolve_ref, rev_list,
-    rev_list_with_boundaries, rev_list_with_parents, the_repository, DiffTreeItem, FileMode,
-    MaybeBoundary, RefTransaction,
+    lookup_replace_commit, object_id, reachable_subset, remote, repository, reprepare_packed_git,
+    resolve_ref, rev_list, rev_list_with_boundaries, rev_list_with_parents, the_repository,
+    DiffTreeItem, FileMode, MaybeBoundary, ObjReadLock, RefTransaction,
 };
 use logging::{LoggingReader, LoggingWriter};
 use oid::{Abbrev, ObjectId};
@@ -128,7 +134,7 @@ use store::{
     METADATA_REF, NOTES_REF, REFS_PREFIX, REPLACE_REFS_PREFIX,
 };
 use tee::TeeReader;
-use tree_util::{diff_by_path, merge_join_by_path, NoRecurse, RecurseTree};
+use tree_util::{diff_by_path, merge_join_by_path, MayRecurse, NoRecurse, RecurseTree};
 use url::Url;
 use util::{CStrExt, IteratorExt, OsStrExt, SliceExt, Transpose};
 #[cfg(windows)]
@@ -137,7 +143,7 @@ use windows_sys::Win32;
 use crate::hg_bundle::BundleReader;
 use crate::hg_connect::{decodecaps, find_common, UnbundleResponse};
 use crate::libcinnabar::AsStrSlice;
-use crate::progress::set_progress;
+use crate::progress::{progress_enabled, set_progress};
 use crate::store::{clear_manifest_heads, do_set_replace, set_changeset_heads, Dag};
 use crate::tree_util::{Empty, ParseTree, WithPath};
 use crate::util::{FromBytes, ToBoxed};
@@ -170,6 +176,8 @@ pub const CARGO_PKG_REPOSITORY: &str = env!("CARGO_PKG_REPOSITORY");
 extern "C" {
     fn do_cleanup(rollback: c_int);
 
+    fn fast_import_pack_open() -> c_int;
+
     #[cfg(windows)]
     fn wmain(argc: c_int, argv: *const *const u16) -> c_int;
 
@@ -232,6 +240,57 @@ fn do_done_and_check(store: &mut Store, args: &[&[u8]]) -> bool {
     do_check_files(store)
 }
 
+// Called once at the end of commands that import from a mercurial remote
+// or bundle.
+fn maintenance_after_import() {
+    if get_typed_config::<bool>("maintenance").unwrap_or(false) {
+        if let Err(e) = do_maintenance() {
+            warn!(target: "root", "{}", e);
+        }
+    }
+}
+
+// Write an incremental (split) commit-graph covering everything reachable
+// from refs, which includes the metadata and manifest commits under
+// refs/cinnabar, and
+// incrementally repack into a multi-pack-index with a reachability bitmap.
+fn do_maintenance() -> Result<(), String> {
+    let progress = progress_enabled();
+    let mut commit_graph = Command::new("git");
+    commit_graph
+        .args(["commit-graph", "write", "--reachable", "--split"])
+        .arg(if progress {
+            "--progress"
+        } else {
+            "--no-progress"
+        });
+    let mut repack = Command::new("git");
+    repack.args([
+        "repack",
+        "-d",
+        "--geometric=2",
+        "--write-midx",
+        "--write-bitmap-index",
+    ]);
+    if !progress {
+        repack.arg("-q");
+    }
+    for (name, mut command) in [("commit-graph", commit_graph), ("repack", repack)] {
+        let status = command
+            // When running as a remote helper, stdout is the channel with git.
+            .stdout(Stdio::null())
+            .status()
+            .map_err(|e| e.to_string())?;
+        if !status.success() {
+            return Err(format!("git {} failed", name));
+        }
+    }
+    unsafe {
+        reprepare_packed_git(the_repository);
+    }
+    Ok(())
+}
+
 #[cfg(unix)]
 pub fn prepare_arg(arg: OsString) -> CString {
     arg.to_cstring()
@@ -306,13 +365,13 @@ where
     Ok(())
 }
 
+fn read_data_changeset(store: &Store, rev: Abbrev<HgChangesetId>) -> Option<RawHgChangeset> {
+    Some(RawHgChangeset::read(store, rev.to_git(store)?).unwrap())
+}
+
 fn do_data_changeset(store: &Store, rev: Abbrev<HgChangesetId>) -> Result<(), String> {
-    let changeset = RawHgChangeset::read(
-        store,
-        rev.to_git(store)
-            .ok_or_else(|| format!("Unknown changeset id: {}", rev))?,
-    )
-    .unwrap();
+    let changeset =
+        read_data_changeset(store, rev).ok_or_else(|| format!("Unknown changeset id: {}", rev))?;
     stdout().write_all(&changeset).map_err(|e| e.to_string())
 }
 
@@ -507,7 +566,7 @@ impl HgConnection for BundleSaverConnection {
         heads: &[HgChangesetId],
         common: &[HgChangesetId],
         bundle2caps: Option<&str>,
-    ) -> Result<Box<dyn std::io::Read + 'a>, util::ImmutBString> {
+    ) -> Result<Box<dyn std::io::Read + Send + 'a>, util::ImmutBString> {
         let reader = self.0.getbundle(heads, common, bundle2caps)?;
         let mut stdout = std::io::stdout();
         let mut bundle = BundleReader::new(TeeReader::new(reader, &mut stdout)).unwrap();
@@ -564,6 +623,10 @@ impl HgConnection for BundleSaverConnection {
         self.0.lookup(key)
     }
 
+    fn lookups(&mut self, keys: &[&str]) -> Vec<util::ImmutBString> {
+        self.0.lookups(keys)
+    }
+
     fn clonebundles(&mut self) -> util::ImmutBString {
         unimplemented!();
     }
@@ -855,53 +918,60 @@ fn do_fetch(
     if bundle {
         conn = Box::new(BundleSaverConnection(conn));
     }
-    let supports_lookup = OnceCell::new();
     let revs = revs
         .iter()
         .map(|rev| match rev.to_string_lossy() {
-            Cow::Borrowed(s) => match HgChangesetId::from_str(s) {
-                Ok(h) => Ok(Either::Left(h)),
-                Err(_)
-                    if *supports_lookup
-                        .get_or_init(|| conn.get_capability(b"lookup").is_some()) =>
-                {
-                    let result = conn.lookup(s);
-                    let [success, data] = result
-                        .trim_end_with(|b| b.is_ascii_whitespace())
-                        .splitn_exact(b' ')
-                        .expect("lookup command result is malformed");
-                    if success == b"0" {
-                        return Err(data.to_str_lossy().into_owned());
-                    }
-                    Ok(Either::Right(
-                        data.to_str()
-                            .ok()
-                            .and_then(|d| HgChangesetId::from_str(d).ok())
-                            .expect("lookup command result is malformed"),
-                    ))
-                }
-                Err(_) => Err(format!(
-                    "Remote repository does not support the \"lookup\" command. \
-                    Cannot fetch {}.",
-                    s
-                )),
-            },
+            Cow::Borrowed(s) => Ok(HgChangesetId::from_str(s).map_err(|_| s)),
             Cow::Owned(s) => Err(format!("Invalid character in revision: {}", s)),
         })
         .collect::<Result<Vec<_>, _>>()?;
-    let unknown = revs
+    // Resolve all the symbolic revisions at once, so that the lookups can be
+    // pipelined.
+    let to_lookup = revs
         .iter()
-        .filter_map(|r| r.left())
-        .chunks(conn.sample_size())
+        .filter_map(|r| r.as_ref().err().copied())
+        .collect_vec();
+    if let Some(s) = to_lookup.first() {
+        if conn.get_capability(b"lookup").is_none() {
+            return Err(format!(
+                "Remote repository does not support the \"lookup\" command. \
+                Cannot fetch {}.",
+                s
+            ));
+        }
+    }
+    let mut lookups = conn.lookups(&to_lookup).into_iter();
+    let revs = revs
         .into_iter()
-        .find_map(|chunk| {
-            let chunk = chunk.collect_vec();
-            conn.known(&chunk)
+        .map(|rev| match rev {
+            Ok(h) => Ok(Either::Left(h)),
+            Err(_) => {
+                let result = lookups.next().unwrap();
+                let [success, data] = result
+                    .trim_end_with(|b| b.is_ascii_whitespace())
+                    .splitn_exact(b' ')
+                    .expect("lookup command result is malformed");
+                if success == b"0" {
+                    return Err(data.to_str_lossy().into_owned());
+                }
+                Ok(Either::Right(
+                    data.to_str()
+                        .ok()
+                        .and_then(|d| HgChangesetId::from_str(d).ok())
+                        .expect("lookup command result is malformed"),
+                ))
+            }
+        })
+        .collect::<Result<Vec<_>, _>>()?;
+    let hashes = revs.iter().filter_map(|r| r.left()).collect_vec();
+    let unknown = (!hashes.is_empty())
+        .then(|| conn.known(&hashes))
+        .and_then(|known| {
+            known
                 .iter()
-                .zip(&chunk)
-                .filter(|(known, _)| !**known)
+                .zip(&hashes)
+                .find(|(known, _)| !**known)
                 .map(|(_, h)| *h)
-                .next()
         });
     if let Some(unknown) = unknown {
         return Err(format!("Unknown revision: {}", unknown));
@@ -935,6 +1005,7 @@ fn do_fetch(
             do_done_and_check(store, &[])
                 .then_some(())
                 .ok_or_else(|| "Fatal error".to_string())?;
+            maintenance_after_import();
         }
     }
 
@@ -1281,6 +1352,10 @@ fn do_reclone(store: &mut Store, rebase: bool) -> Result<(), String> {
 
     let mut update_refs_by_category = Vec::new();
 
+    // Recloning can involve fetching a lot of data from several remotes.
+    // Don't let the network wait for the import.
+    set_spool_bundles(true);
+
     for_each_remote(|remote| {
         if remote.skip_default_update() {
             return Ok(());
@@ -1417,25 +1492,21 @@ fn do_reclone(store: &mut Store, rebase: bool) -> Result<(), String> {
             println!("Fetching {}", remote.name().unwrap().to_string_lossy());
             let mut conn = get_connection(&url).unwrap();
 
-            let knowns = unknowns
-                .chunks(conn.sample_size())
-                .map(|unknowns| {
-                    conn.known(&unknowns.iter().map(|(_, csid)| *csid).collect_vec())
-                        .into_vec()
-                        .into_iter()
-                })
-                .collect_vec();
-
-            let (knowns, u): (Vec<_>, Vec<_>) = unknowns
-                .drain(..)
-                .zip(knowns.into_iter().flatten())
-                .partition_map(|(ids, known)| {
-                    if known {
-                        Either::Left(ids)
-                    } else {
-                        Either::Right(ids)
-                    }
-                });
+            let knowns = conn
+                .known(&unknowns.iter().map(|(_, csid)| *csid).collect_vec())
+                .into_vec();
+
+            let (knowns, u): (Vec<_>, Vec<_>) =
+                unknowns
+                    .drain(..)
+                    .zip(knowns)
+                    .partition_map(|(ids, known)| {
+                        if known {
+                            Either::Left(ids)
+                        } else {
+                            Either::Right(ids)
+                        }
+                    });
             unknowns = u;
             if !knowns.is_empty() {
                 get_bundle(
@@ -1759,6 +1830,7 @@ fn do_reclone(store: &mut Store, rebase: bool) -> Result<(), String> {
     })
     .map(|()| {
         *old_store = store;
+        maintenance_after_import();
         if !rebase {
             // TODO: Avoid showing this message when we detect there is nothing
             // to rebase.
@@ -2128,17 +2200,294 @@ fn do_setup() -> Result<(), String> {
     Ok(())
 }
 
-fn do_data_file(store: &Store, rev: Abbrev<HgFileId>) -> Result<(), String> {
-    let mut stdout = stdout();
-    let file_id = rev
-        .to_git(store)
-        .ok_or_else(|| format!("Unknown file id: {}", rev))?;
+fn read_data_file(store: &Store, rev: Abbrev<HgFileId>) -> Option<RawHgFile> {
+    let file_id = rev.to_git(store)?;
     let metadata_id = store
         .files_meta_mut()
         .get_note_abbrev(rev)
         .map(|oid| GitFileMetadataId::from_unchecked(BlobId::from_unchecked(oid)));
-    let file = RawHgFile::read(file_id, metadata_id).unwrap();
-    stdout.write_all(&file).map_err(|e| e.to_string())
+    Some(RawHgFile::read(file_id, metadata_id).unwrap())
+}
+
+fn do_data_file(store: &Store, rev: Abbrev<HgFileId>) -> Result<(), String> {
+    let file = read_data_file(store, rev).ok_or_else(|| format!("Unknown file id: {}", rev))?;
+    stdout().write_all(&file).map_err(|e| e.to_string())
+}
+
+enum DataRequest {
+    Changeset(Abbrev<HgChangesetId>),
+    Manifest(Abbrev<HgManifestId>),
+    File(Abbrev<HgFileId>),
+}
+
+impl FromStr for DataRequest {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, String> {
+        fn parse<T: FromStr>(id: &str) -> Result<T, String>
+        where
+            <T as FromStr>::Err: fmt::Display,
+        {
+            T::from_str(id).map_err(|e| format!("{}: {}", id, e))
+        }
+        match s.split_once(' ') {
+            Some(("changeset", id)) => parse(id).map(DataRequest::Changeset),
+            Some(("manifest", id)) => parse(id).map(DataRequest::Manifest),
+            Some(("file", id)) => parse(id).map(DataRequest::File),
+            _ => Err(format!("Invalid request: {}", s)),
+        }
+    }
+}
+
+/// Serve `<type> <id>` requests read from stdin, where type is one of
+/// `changeset`, `manifest` or `file`. Each object is written as a
+/// `<type> <id> <size>` line followed by its raw contents and a newline,
+/// or as a `<type> <id> missing` line when it is unknown. Lines that are
+/// not valid requests get a `<line> invalid` line.
+///
+/// By default, each request is answered, and the output flushed, before
+/// the next one is read. With `buffer`, like `git cat-file --buffer`,
+/// requests are handled in groups, each group ending with an empty line or
+/// the end of the input, and the output is only flushed after each group.
+/// Within a group, manifests then come last, in an order that allows to
+/// derive each of them from the previous one cheaply.
+fn do_data_batch(store: &Store, buffer: bool) -> Result<(), String> {
+    let out = stdout();
+    data_batch(
+        stdin().lock(),
+        BufWriter::new(out.lock()),
+        buffer,
+        |requests, out| do_data_requests(store, requests, out),
+    )
+}
+
+fn data_batch<W: Write>(
+    input: impl BufRead,
+    mut out: W,
+    buffer: bool,
+    mut serve: impl FnMut(Vec<DataRequest>, &mut W) -> Result<(), String>,
+) -> Result<(), String> {
+    let mut requests = Vec::new();
+    let mut lines = input.lines();
+    loop {
+        let line = lines.next().transpose().map_err(|e| e.to_string())?;
+        match line.as_deref() {
+            Some("") | None => {
+                if !requests.is_empty() {
+                    serve(mem::take(&mut requests), &mut out)?;
+                }
+                out.flush().map_err(|e| e.to_string())?;
+                if line.is_none() {
+                    return Ok(());
+                }
+            }
+            // Like `git cat-file --batch`, don't let one bad request
+            // interrupt the session.
+            Some(line) => {
+                match DataRequest::from_str(line) {
+                    Ok(request) => requests.push(request),
+                    Err(_) => writeln!(out, "{} invalid", line).map_err(|e| e.to_string())?,
+                }
+                if !buffer {
+                    if !requests.is_empty() {
+                        serve(mem::take(&mut requests), &mut out)?;
+                    }
+                    out.flush().map_err(|e| e.to_string())?;
+                }
+            }
+        }
+    }
+}
+
+fn do_data_requests(
+    store: &Store,
+    requests: Vec<DataRequest>,
+    mut out: impl Write,
+) -> Result<(), String> {
+    let mut manifests = Vec::new();
+    for request in requests {
+        match request {
+            DataRequest::Changeset(c) => {
+                let changeset = read_data_changeset(store, c);
+                write_data_record(&mut out, "changeset", c, changeset.as_deref())?;
+            }
+            DataRequest::File(f) => {
+                let file = read_data_file(store, f);
+                write_data_record(&mut out, "file", f, file.as_deref())?;
+            }
+            DataRequest::Manifest(m) => match m.to_git(store) {
+                Some(mid) => manifests.push((m, mid)),
+                None => write_data_record(&mut out, "manifest", m, None)?,
+            },
+        }
+    }
+    let order = order_for_delta_reuse(
+        &manifests.iter().map(|(_, mid)| *mid).collect_vec(),
+        |mid| {
+            let commit = RawCommit::read(mid.into()).unwrap();
+            let commit = commit.parse().unwrap();
+            commit
+                .parents()
+                .iter()
+                .map(|p| GitManifestId::from_unchecked(*p))
+                .collect()
+        },
+    );
+    for i in order {
+        let (m, mid) = manifests[i];
+        let manifest = RawHgManifest::read(mid).unwrap();
+        write_data_record(&mut out, "manifest", m, Some(&manifest))?;
+    }
+    Ok(())
+}
+
+fn write_data_record(
+    mut out: impl Write,
+    typ: &str,
+    id: impl fmt::Display,
+    data: Option<&[u8]>,
+) -> Result<(), String> {
+    (|| {
+        if let Some(data) = data {
+            writeln!(out, "{} {} {}", typ, id, data.len())?;
+            out.write_all(data)?;
+            out.write_all(b"\n")
+        } else {
+            writeln!(out, "{} {} missing", typ, id)
+        }
+    })()
+    .map_err(|e| e.to_string())
+}
+
+// RawHgManifest::read derives a manifest from the last one it read, at a
+// cost proportional to the difference between the two. Place each node
+// right after one of its parents when both are requested (or after the
+// same node, when requested several times), keeping the input order
+// otherwise.
+fn order_for_delta_reuse<T: Copy + Eq + Hash>(
+    nodes: &[T],
+    parents: impl Fn(T) -> Vec<T>,
+) -> Vec<usize> {
+    let mut first_index = HashMap::new();
+    for (i, node) in nodes.iter().enumerate() {
+        first_index.entry(*node).or_insert(i);
+    }
+    let mut children = vec![Vec::new(); nodes.len()];
+    let mut roots = Vec::new();
+    for (i, node) in nodes.iter().enumerate() {
+        let first = first_index[node];
+        let after = if first != i {
+            Some(first)
+        } else {
+            parents(*node)
+                .into_iter()
+                .find_map(|p| first_index.get(&p).copied())
+        };
+        match after {
+            Some(after) => children[after].push(i),
+            None => roots.push(i),
+        }
+    }
+    let mut order = Vec::with_capacity(nodes.len());
+    let mut stack = roots;
+    stack.reverse();
+    while let Some(i) = stack.pop() {
+        order.push(i);
+        stack.extend(children[i].iter().rev());
+    }
+    order
+}
+
+#[test]
+fn test_data_batch() {
+    let input = [
+        "changeset 0123456789abcdef0123456789abcdef01234567",
+        "foo 0123456789abcdef0123456789abcdef01234567",
+        "file 0123",
+        "",
+        "manifest 0123456789abcdef0123456789abcdef0123456z",
+        "",
+        "",
+        "manifest fedc",
+    ]
+    .join("\n");
+    let run = |buffer| {
+        let mut groups = Vec::new();
+        let mut out = Vec::new();
+        data_batch(input.as_bytes(), &mut out, buffer, |requests, out| {
+            groups.push(requests.len());
+            for request in requests {
+                match request {
+                    DataRequest::Changeset(c) => {
+                        write_data_record(&mut *out, "changeset", c, Some(&b"foo\nbar"[..]))?
+                    }
+                    DataRequest::Manifest(m) => {
+                        write_data_record(&mut *out, "manifest", m, Some(&[]))?
+                    }
+                    DataRequest::File(f) => write_data_record(&mut *out, "file", f, None)?,
+                }
+            }
+            Ok(())
+        })
+        .unwrap();
+        (groups, out)
+    };
+    let expected = [
+        "changeset 0123456789abcdef0123456789abcdef01234567 7",
+        "foo",
+        "bar",
+        "foo 0123456789abcdef0123456789abcdef01234567 invalid",
+        "file 0123 missing",
+        "manifest 0123456789abcdef0123456789abcdef0123456z invalid",
+        "manifest fedc 0",
+        "",
+        "",
+    ]
+    .join("\n");
+
+    let (groups, out) = run(false);
+    assert_eq!(groups, [1, 1, 1]);
+    assert_eq!(out.as_bstr(), expected.as_bstr());
+
+    // When buffering, invalid requests are reported right away, before the
+    // group they were in is served.
+    let (groups, out) = run(true);
+    assert_eq!(groups, [2, 1]);
+    assert_eq!(
+        out.as_bstr(),
+        [
+            "foo 0123456789abcdef0123456789abcdef01234567 invalid",
+            "changeset 0123456789abcdef0123456789abcdef01234567 7",
+            "foo",
+            "bar",
+            "file 0123 missing",
+            "manifest 0123456789abcdef0123456789abcdef0123456z invalid",
+            "manifest fedc 0",
+            "",
+            "",
+        ]
+        .join("\n")
+        .as_bstr()
+    );
+}
+
+#[test]
+fn test_order_for_delta_reuse() {
+    // 1 - 2 - 3 - 4
+    //      \
+    //       5
+    let parents = |n: u32| match n {
+        1 => vec![],
+        5 => vec![2],
+        n => vec![n - 1],
+    };
+    assert_eq!(
+        order_for_delta_reuse(&[4, 1, 3, 5, 2], parents),
+        [1, 4, 2, 0, 3]
+    );
+    assert_eq!(order_for_delta_reuse(&[4, 1, 4, 3], parents), [1, 3, 0, 2]);
+    assert_eq!(order_for_delta_reuse(&[5, 4, 3], parents), [0, 2, 1]);
+    assert!(order_for_delta_reuse(&[], parents).is_empty());
 }
 
 pub fn graft_config_enabled(remote: Option<&str>) -> Result<Option<Either<bool, Url>>, String> {
@@ -2187,7 +2536,9 @@ fn do_unbundle(store: &mut Store, clonebundle: bool, mut url: OsString) -> Resul
 
     do_done_and_check(store, &[])
         .then_some(())
-        .ok_or_else(|| "Fatal error".to_string())
+        .ok_or_else(|| "Fatal error".to_string())?;
+    maintenance_after_import();
+    Ok(())
 }
 
 fn do_bundle(
@@ -2227,8 +2578,7 @@ fn do_bundle(
     result
 }
 
-fn create_file(store: &Store, blobid: BlobId, parents: &[HgFileId]) -> HgFileId {
-    let blob = RawBlob::read(blobid).unwrap();
+fn hash_file(data: &[u8], parents: &[HgFileId]) -> HgFileId {
     let mut hash = HgFileId::create();
     if parents.len() < 2 {
         hash.update(HgFileId::NULL.as_raw_bytes());
@@ -2239,12 +2589,84 @@ fn create_file(store: &Store, blobid: BlobId, parents: &[HgFileId]) -> HgFileId
             hash.update(parent.as_raw_bytes());
         }
     }
-    hash.update(blob.as_bytes());
-    let fid = hash.finalize();
+    hash.update(data);
+    hash.finalize()
+}
+
+fn store_file(store: &Store, fid: HgFileId, blobid: BlobId, parents: &[HgFileId]) {
+    record_file_parents(fid, parents.first().copied(), parents.get(1).copied());
     store.set(SetWhat::File, fid.into(), blobid.into());
+}
+
+fn create_file(store: &Store, blobid: BlobId, parents: &[HgFileId]) -> HgFileId {
+    let blob = RawBlob::read(blobid).unwrap();
+    let fid = hash_file(blob.as_bytes(), parents);
+    store_file(store, fid, blobid, parents);
     fid
 }
 
+// Upper bound for the amount of blob data held in memory at once by
+// `create_files`.
+const CREATE_FILES_BATCH_SIZE: usize = 64 * 1024 * 1024;
+
+// Equivalent to calling `create_file` for each of the given files, in order.
+// Blobs can only be read from the main thread, but hashing them is pure
+// computation, which is spread across threads.
+fn create_files(store: &Store, files: &[(BlobId, Option<HgFileId>)]) -> Vec<HgFileId> {
+    let threads = thread::available_parallelism().map_or(1, NonZeroUsize::get);
+    let mut result = Vec::with_capacity(files.len());
+    let mut remaining = files;
+    while !remaining.is_empty() {
+        let mut blobs = Vec::new();
+        let mut size = 0;
+        for (blobid, _) in remaining {
+            if size >= CREATE_FILES_BATCH_SIZE {
+                break;
+            }
+            let blob = RawBlob::read(*blobid).unwrap();
+            size += blob.as_bytes().len();
+            blobs.push(blob);
+        }
+        let (batch, rest) = remaining.split_at(blobs.len());
+        remaining = rest;
+        let items = blobs
+            .iter()
+            .zip(batch)
+            .map(|(blob, (_, parent))| (blob.as_bytes(), parent.as_slice()))
+            .collect_vec();
+        let fids = if threads < 2 || items.len() < 2 {
+            items
+                .iter()
+                .map(|(data, parents)| hash_file(data, parents))
+                .collect_vec()
+        } else {
+            let chunk_size = items.len().div_ceil(threads);
+            thread::scope(|s| {
+                let handles = items
+                    .chunks(chunk_size)
+                    .map(|chunk| {
+                        s.spawn(move || {
+                            chunk
+                                .iter()
+                                .map(|(data, parents)| hash_file(data, parents))
+                                .collect_vec()
+                        })
+                    })
+                    .collect_vec();
+                handles
+                    .into_iter()
+                    .flat_map(|h| h.join().unwrap())
+                    .collect_vec()
+            })
+        };
+        for (fid, (blobid, parent)) in fids.into_iter().zip(batch) {
+            store_file(store, fid, *blobid, parent.as_slice());
+            result.push(fid);
+        }
+    }
+    result
+}
+
 fn create_copy(
     store: &Store,
     blobid: BlobId,
@@ -2268,6 +2690,7 @@ fn create_copy(
     hash.update(blob.as_bytes());
     let fid = hash.finalize();
 
+    record_file_parents(fid, None, None);
     let oid = store_git_blob(&metadata);
     store.set(SetWhat::FileMeta, fid.into(), oid.into());
     store.set(SetWhat::File, fid.into(), blobid.into());
@@ -2329,15 +2752,23 @@ fn create_root_changeset(store: &Store, cid: CommitId, branch: Option<&BStr>) ->
     }
     let mut manifest = Vec::new();
     let mut paths = Vec::new();
-    for entry in RawTree::read_treeish(cid)
+    let entries = RawTree::read_treeish(cid)
         .unwrap()
         .into_iter()
         .recurse()
-        .map_map(|item| ManifestEntry {
-            fid: create_file(store, item.oid.try_into().unwrap(), &[]),
+        .collect_vec();
+    let fids = create_files(
+        store,
+        &entries
+            .iter()
+            .map(|entry| (BlobId::try_from(entry.inner().oid).unwrap(), None))
+            .collect_vec(),
+    );
+    for (entry, fid) in entries.into_iter().zip(fids) {
+        let entry = entry.map(|item| ManifestEntry {
+            fid,
             attr: item.mode.try_into().unwrap(),
-        })
-    {
+        });
         RawHgManifest::write_one_entry(&entry, &mut manifest).unwrap();
         paths.extend_from_slice(entry.path());
         paths.push(b'\0');
@@ -2428,6 +2859,25 @@ fn create_simple_manifest(
         .lines_with_terminator()
         .map(ManifestLine::from)
         .collect::<Vec<_>>();
+    // Create the new files upfront, in the order they will be needed below,
+    // so that their contents can be hashed in parallel.
+    let new_files = diff
+        .iter()
+        .filter_map(|item| match item.inner() {
+            DiffTreeItem::Modified { from, to } if from.oid != to.oid => {
+                let line = parent_lines
+                    .binary_search_by_key(&&**item.path(), |e| e.path())
+                    .ok()?;
+                Some((
+                    BlobId::try_from(to.oid).unwrap(),
+                    Some(parent_lines[line].fid()),
+                ))
+            }
+            DiffTreeItem::Added(added) => Some((BlobId::try_from(added.oid).unwrap(), None)),
+            _ => None,
+        })
+        .collect_vec();
+    let mut new_fids = create_files(store, &new_files).into_iter();
     let mut manifest = Vec::new();
     let mut paths = Vec::new();
     for (path, either_or_both) in parent_lines
@@ -2460,7 +2910,7 @@ fn create_simple_manifest(
             EitherOrBoth::Both(line, DiffTreeItem::Modified { from, to }) => {
                 let mut fid = line.fid();
                 if from.oid != to.oid {
-                    fid = create_file(store, to.oid.try_into().unwrap(), &[fid]);
+                    fid = new_fids.next().unwrap();
                 }
                 (fid, to.mode)
             }
@@ -2482,10 +2932,9 @@ fn create_simple_manifest(
                 ),
                 to.mode,
             ),
-            EitherOrBoth::Right(DiffTreeItem::Added(added)) => (
-                create_file(store, added.oid.try_into().unwrap(), &[]),
-                added.mode,
-            ),
+            EitherOrBoth::Right(DiffTreeItem::Added(added)) => {
+                (new_fids.next().unwrap(), added.mode)
+            }
 
             thing => die!("Something went wrong {:?}", thing),
         };
@@ -3687,18 +4136,240 @@ fn get_changes(
     }
 }
 
-fn manifest_diff(a: CommitId, b: CommitId) -> impl Iterator<Item = WithPath<(HgFileId, HgFileId)>> {
-    let a = GitManifestTree::read_treeish(GitManifestId::from_unchecked(a)).unwrap();
-    let b = GitManifestTree::read_treeish(GitManifestId::from_unchecked(b)).unwrap();
-    diff_by_path(a, b)
-        .recurse()
-        .map_map(|entry| match entry {
-            Right(added) => Some((added.fid, HgFileId::NULL)),
-            Both(from, to) if from.fid != to.fid => Some((to.fid, from.fid)),
-            Left(deleted) => Some((HgFileId::NULL, deleted.fid)),
-            _ => None,
+// Minimum number of top-level subtrees that differ between two manifest
+// trees for their diff to be spread across threads.
+const PARALLEL_DIFF_MIN_SUBTREES: usize = 4;
+
+// Recursive diff between two manifest trees. Reading objects from several
+// threads is not safe while fast-import has a pack open, which happens when
+// creating merge changesets during push, so the diff is not parallelized
+// then.
+fn manifest_tree_diff(
+    a: GitManifestTreeId,
+    b: GitManifestTreeId,
+) -> impl Iterator<Item = WithPath<EitherOrBoth<ManifestEntry, ManifestEntry>>> {
+    let read_tree = |t: Option<GitManifestTreeId>| {
+        t.map_or_else(GitManifestTree::empty, |t| {
+            GitManifestTree::read(t).unwrap()
+        })
+    };
+    let threads = if unsafe { fast_import_pack_open() } != 0 {
+        1
+    } else {
+        thread::available_parallelism().map_or(1, NonZeroUsize::get)
+    };
+    tree_diff_from_top_level(
+        diff_by_path(read_tree(Some(a)), read_tree(Some(b))).collect_vec(),
+        threads,
+        move |a, b| diff_by_path(read_tree(a), read_tree(b)).recurse(),
+        // Object reading in git is only thread-safe with this lock enabled.
+        ObjReadLock::new,
+    )
+}
+
+// Recursive diff between two trees, from their top-level diff. When enough
+// top-level subtrees differ and more than one thread is allowed, the
+// subtrees are diffed in parallel while holding what `lock` returns, each
+// thread picking the next subtree pair when it's done with one. Otherwise,
+// they are diffed lazily, as the result is iterated. The result is in path
+// order either way.
+fn tree_diff_from_top_level<T, E, D, L>(
+    top_level: Vec<WithPath<EitherOrBoth<Either<T, E>, Either<T, E>>>>,
+    threads: usize,
+    diff_subtrees: impl Fn(Option<T>, Option<T>) -> D + Sync,
+    lock: impl FnOnce() -> L,
+) -> impl Iterator<Item = WithPath<EitherOrBoth<E, E>>>
+where
+    T: Copy + Sync,
+    E: Send,
+    Either<T, E>: MayRecurse,
+    D: Iterator<Item = WithPath<EitherOrBoth<E, E>>>,
+{
+    let subtrees = |entry: &EitherOrBoth<Either<T, E>, Either<T, E>>| {
+        entry.may_recurse().then(|| {
+            let (l, r) = entry.as_ref().left_and_right();
+            (
+                l.map(|l| *l.as_ref().left().unwrap()),
+                r.map(|r| *r.as_ref().left().unwrap()),
+            )
         })
-        .filter_map(Transpose::transpose)
+    };
+    let jobs = top_level
+        .iter()
+        .filter_map(|entry| subtrees(entry.inner()))
+        .collect_vec();
+    let mut results = (threads >= 2 && jobs.len() >= PARALLEL_DIFF_MIN_SUBTREES).then(|| {
+        let next_job = AtomicUsize::new(0);
+        let _lock = lock();
+        let mut results = thread::scope(|s| {
+            let workers = (0..cmp::min(threads, jobs.len()))
+                .map(|_| {
+                    thread::Builder::new()
+                        .name("diff".into())
+                        .spawn_scoped(s, || {
+                            let mut results = Vec::new();
+                            loop {
+                                let job = next_job.fetch_add(1, AtomicOrdering::Relaxed);
+                                let Some(&(a, b)) = jobs.get(job) else {
+                                    break;
+                                };
+                                results.push((job, diff_subtrees(a, b).collect_vec()));
+                            }
+                            results
+                        })
+                        .unwrap()
+                })
+                .collect_vec();
+            workers
+                .into_iter()
+                .flat_map(|worker| worker.join().unwrap())
+                .collect_vec()
+        });
+        results.sort_unstable_by_key(|(job, _)| *job);
+        results.into_iter().map(|(_, diff)| diff)
+    });
+
+    top_level.into_iter().flat_map(move |entry| {
+        let (prefix, inner) = entry.unzip();
+        if let Some((a, b)) = subtrees(&inner) {
+            let diff = match &mut results {
+                Some(results) => Either::Left(results.next().unwrap().into_iter()),
+                None => Either::Right(diff_subtrees(a, b)),
+            };
+            Either::Left(diff.map(move |item| {
+                let (path, inner) = item.unzip();
+                let mut full_path = Vec::with_capacity(prefix.len() + path.len() + 1);
+                full_path.extend_from_slice(&prefix);
+                full_path.push(b'/');
+                full_path.extend_from_slice(&path);
+                WithPath::new(full_path, inner)
+            }))
+        } else {
+            Either::Right(iter::once(WithPath::new(
+                prefix,
+                inner.map_any(|l| l.right().unwrap(), |r| r.right().unwrap()),
+            )))
+        }
+    })
+}
+
+#[test]
+fn test_tree_diff_from_top_level() {
+    use tree_util::RecurseAs;
+
+    #[derive(Clone, Copy, Debug, PartialEq)]
+    struct TreeId(usize);
+
+    type TreeEntry = Either<TreeId, u32>;
+
+    struct Tree(std::vec::IntoIter<WithPath<TreeEntry>>);
+
+    impl Iterator for Tree {
+        type Item = WithPath<TreeEntry>;
+
+        fn next(&mut self) -> Option<Self::Item> {
+            self.0.next()
+        }
+    }
+
+    impl Empty for Tree {
+        fn empty() -> Self {
+            Tree(Vec::new().into_iter())
+        }
+    }
+
+    impl MayRecurse for TreeEntry {
+        fn may_recurse(&self) -> bool {
+            self.is_left()
+        }
+    }
+
+    impl RecurseAs<Tree> for TreeEntry {
+        type NonRecursed = u32;
+
+        fn maybe_recurse(self) -> Either<Tree, u32> {
+            self.map_left(|t| read_tree(Some(t)))
+        }
+    }
+
+    fn read_tree(t: Option<TreeId>) -> Tree {
+        let file = |path: &str, fid| WithPath::new(path.as_bytes(), Either::Right(fid));
+        let tree = |path: &str, tid| WithPath::new(path.as_bytes(), Either::Left(TreeId(tid)));
+        Tree(
+            match t.map(|t| t.0) {
+                None => vec![],
+                Some(0) => vec![
+                    file("a", 1),
+                    tree("b", 1),
+                    tree("c", 2),
+                    file("d", 1),
+                    tree("e", 3),
+                    tree("f", 4),
+                    tree("g", 5),
+                    file("h", 1),
+                ],
+                Some(10) => vec![
+                    file("a", 2),
+                    tree("b", 11),
+                    tree("c", 2),
+                    tree("e", 13),
+                    file("f", 1),
+                    tree("g", 15),
+                    file("h", 1),
+                    tree("i", 16),
+                ],
+                Some(1) => vec![file("x", 1), tree("y", 6)],
+                Some(11) => vec![file("x", 2), tree("y", 7)],
+                Some(2) => vec![file("q", 1)],
+                Some(3) => vec![file("p", 1)],
+                Some(13) => vec![file("p", 1), file("p2", 2)],
+                Some(4) => vec![file("r", 1)],
+                Some(5) => vec![file("s", 1)],
+                Some(15) => vec![file("s", 2)],
+                Some(6) => vec![file("z", 1)],
+                Some(7) => vec![file("w", 3), file("z", 1)],
+                Some(16) => vec![file("t", 1), tree("u", 6)],
+                Some(t) => panic!("unknown tree {}", t),
+            }
+            .into_iter(),
+        )
+    }
+
+    let (a, b) = (Some(TreeId(0)), Some(TreeId(10)));
+    let serial = diff_by_path(read_tree(a), read_tree(b))
+        .recurse()
+        .collect_vec();
+    assert_eq!(
+        serial
+            .iter()
+            .map(|entry| entry.path().to_string())
+            .collect_vec(),
+        ["a", "b/x", "b/y/w", "d", "e/p2", "f", "f/r", "g/s", "i/t", "i/u/z"]
+    );
+    for threads in [1, 2, 4, 16] {
+        let diff = tree_diff_from_top_level(
+            diff_by_path(read_tree(a), read_tree(b)).collect_vec(),
+            threads,
+            |a, b| diff_by_path(read_tree(a), read_tree(b)).recurse(),
+            || (),
+        )
+        .collect_vec();
+        assert_eq!(diff, serial, "with {} threads", threads);
+    }
+}
+
+fn manifest_diff(a: CommitId, b: CommitId) -> impl Iterator<Item = WithPath<(HgFileId, HgFileId)>> {
+    manifest_tree_diff(
+        GitManifestId::from_unchecked(a).get_tree_id(),
+        GitManifestId::from_unchecked(b).get_tree_id(),
+    )
+    .map_map(|entry| match entry {
+        Right(added) => Some((added.fid, HgFileId::NULL)),
+        Both(from, to) if from.fid != to.fid => Some((to.fid, from.fid)),
+        Left(deleted) => Some((HgFileId::NULL, deleted.fid)),
+        _ => None,
+    })
+    .filter_map(Transpose::transpose)
 }
 
 fn manifest_diff2(
@@ -3763,6 +4434,12 @@ enum CinnabarCommand {
         /// Open file
         #[arg(group = "input")]
         file: Option<Abbrev<HgFileId>>,
+        /// Read `<changeset|manifest|file> <sha1>` requests on stdin
+        #[arg(long, group = "input")]
+        batch: bool,
+        /// Only flush the output at empty lines and at the end of the input
+        #[arg(long, requires = "batch")]
+        buffer: bool,
     },
     /// Convert mercurial sha1 to corresponding git sha1
     #[command(name = "hg2git")]
@@ -3878,6 +4555,9 @@ enum CinnabarCommand {
     /// Upgrade cinnabar metadata
     #[command(name = "upgrade")]
     Upgrade,
+    /// Write commit-graph, multi-pack-index and bitmaps for faster git operations
+    #[command(name = "maintenance")]
+    Maintenance,
     /// Update git-cinnabar
     #[cfg(feature = "self-update")]
     #[command(name = "self-update")]
@@ -3895,6 +4575,10 @@ enum CinnabarCommand {
     /// Setup git-cinnabar
     #[command(name = "setup", hide = true)]
     Setup,
+    /// Serve remote-hg sessions for this repository from a long-lived process
+    #[cfg(unix)]
+    #[command(name = "daemon")]
+    Daemon,
 }
 
 #[cfg(feature = "self-update")]
@@ -4007,16 +4691,25 @@ fn git_cinnabar(args: Option<&[&OsStr]>) -> Result<c_int, String> {
     if let Setup = command {
         return do_setup().map(|()| 0);
     }
+    #[cfg(unix)]
+    if let Daemon = command {
+        return daemon::run_daemon();
+    }
     let _v = VersionChecker::new();
     if let RemoteHg { remote, url } = command {
         return git_remote_hg(remote, url);
     }
     let mut store = the_store().unwrap_or_else(|e| panic!("{}", e));
+    if !matches!(command, Data { .. } | Hg2Git { .. } | Git2Hg { .. }) {
+        store.check_legacy_metadata();
+    }
     let ret = match command {
         #[cfg(feature = "self-update")]
         SelfUpdate { .. } => unreachable!(),
         RemoteHg { .. } => unreachable!(),
         Setup => unreachable!(),
+        #[cfg(unix)]
+        Daemon => unreachable!(),
         Data {
             changeset: Some(c), ..
         } => do_data_changeset(&store, c),
@@ -4024,6 +4717,11 @@ fn git_cinnabar(args: Option<&[&OsStr]>) -> Result<c_int, String> {
             manifest: Some(m), ..
         } => do_data_manifest(&store, m),
         Data { file: Some(f), .. } => do_data_file(&store, f),
+        Data {
+            batch: true,
+            buffer,
+            ..
+        } => do_data_batch(&store, buffer),
         Data { .. } => unreachable!(),
         Hg2Git {
             abbrev,
@@ -4077,6 +4775,7 @@ fn git_cinnabar(args: Option<&[&OsStr]>) -> Result<c_int, String> {
             committish,
         } => do_rollback(candidates, fsck, force, committish),
         Upgrade => do_upgrade(),
+        Maintenance => do_maintenance(),
         Unbundle { clonebundle, url } => do_unbundle(&mut store, clonebundle, url),
         Fsck {
             force,
@@ -4514,6 +5213,7 @@ fn remote_helper_import(
         }
     }
 
+    let imported = tags.is_some();
     if let Some(old_tags) = tags {
         if old_tags != store.get_tags() {
             eprintln!(
@@ -4522,6 +5222,10 @@ fn remote_helper_import(
             );
         }
     }
+    // Only after "done" was sent, so that git doesn't wait on it.
+    if imported {
+        maintenance_after_import();
+    }
     Ok(())
 }
 
@@ -5018,7 +5722,16 @@ fn remote_helper_push(
     Ok(())
 }
 
-fn git_remote_hg(remote: OsString, mut url: OsString) -> Result<c_int, String> {
+fn git_remote_hg(remote: OsString, url: OsString) -> Result<c_int, String> {
+    let mut store: Lazy<Result<_, _>> = Lazy::new(the_store);
+    git_remote_hg_with_store(remote, url, &mut store)
+}
+
+fn git_remote_hg_with_store(
+    remote: OsString,
+    mut url: OsString,
+    store: &mut Lazy<Result<Store, &'static str>>,
+) -> Result<c_int, String> {
     if !url.as_bytes().starts_with(b"hg:") {
         let mut new_url = OsString::from("hg::");
         new_url.push(url);
@@ -5036,7 +5749,6 @@ fn git_remote_hg(remote: OsString, mut url: OsString) -> Result<c_int, String> {
     let mut buf = Vec::new();
     let mut dry_run = false;
     let mut info = None;
-    let mut store: Lazy<Result<_, _>> = Lazy::new(the_store);
     loop {
         buf.truncate(0);
         stdin.read_until(b'\n', &mut buf).unwrap();
@@ -5133,8 +5845,10 @@ fn git_remote_hg(remote: OsString, mut url: OsString) -> Result<c_int, String> {
         match cmd {
             b"import" => {
                 assert_ne!(url.scheme(), "tags");
+                let store = store.as_mut().unwrap_or_else(|e| panic!("{}", e));
+                store.check_legacy_metadata();
                 match remote_helper_import(
-                    store.as_mut().unwrap_or_else(|e| panic!("{}", e)),
+                    store,
                     conn.as_deref_mut().unwrap(),
                     remote.as_deref(),
                     &args.iter().map(|r| &**r).collect_vec(),
@@ -5159,8 +5873,10 @@ fn git_remote_hg(remote: OsString, mut url: OsString) -> Result<c_int, String> {
             }
             b"push" => {
                 assert_ne!(url.scheme(), "tags");
+                let store = store.as_mut().unwrap_or_else(|e| panic!("{}", e));
+                store.check_legacy_metadata();
                 remote_helper_push(
-                    store.as_mut().unwrap_or_else(|e| panic!("{}", e)),
+                    store,
                     conn.as_deref_mut().unwrap(),
                     remote.as_deref(),
                     &args.iter().map(|r| &**r).collect_vec(),
@@ -5209,8 +5925,16 @@ unsafe extern "C" fn cinnabar_main(_argc: c_int, argv: *const *const c_char) ->
             );
         }
     }));
+    // Sessions handed over to a daemon don't need git to be initialized.
+    #[cfg(unix)]
+    if argv0_path.file_stem() == Some(OsStr::new("git-remote-hg")) {
+        if let Some(code) = daemon::forward_remote_hg(&std::env::args_os().skip(1).collect_vec()) {
+            return code;
+        }
+    }
     HAS_GIT_REPO = init_cinnabar(exe.as_deref().unwrap_or(argv0).as_ptr()) != 0;
     logging::init(now);
+    trace::init(now);
     experiment(Experiments::MERGE);
 
     let ret = match argv0_path.file_stem().and_then(OsStr::to_str) {
@@ -5229,6 +5953,7 @@ unsafe extern "C" fn cinnabar_main(_argc: c_int, argv: *const *const c_char) ->
         )),
         Some(_) | None => Ok(1),
     };
+    git::log_object_cache_stats();
     if hg_connect_http::CURL_GLOBAL_INIT.get().is_some() {
         unsafe {
             curl_sys::curl_global_cleanup();
@@ -5267,6 +5992,20 @@ impl ConfigType for bool {
     }
 }
 
+impl ConfigType for u64 {
+    fn from_os_string(value: OsString) -> Option<Self::Owned> {
+        // Accept the same unit suffixes as git does for sizes.
+        let value = value.to_str()?;
+        let (num, factor) = match value.as_bytes().last()? {
+            b'k' | b'K' => (&value[..value.len() - 1], 1 << 10),
+            b'm' | b'M' => (&value[..value.len() - 1], 1 << 20),
+            b'g' | b'G' => (&value[..value.len() - 1], 1 << 30),
+            _ => (value, 1),
+        };
+        num.parse::<u64>().ok()?.checked_mul(factor)
+    }
+}
+
 pub fn get_typed_config<T: ConfigType + ?Sized>(name: &str) -> Option<T::Owned> {
     get_config(name).and_then(T::from_os_string)
 }
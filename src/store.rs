@@ -6,18 +6,23 @@ use std::borrow::Cow;
 use std::cell::{Cell, OnceCell, Ref, RefCell, RefMut};
 use std::collections::{BTreeMap, BTreeSet, HashMap, HashSet};
 use std::ffi::OsStr;
+use std::fs::{self, File};
 use std::hash::Hash;
-use std::io::{copy, BufRead, BufReader, Read, Write};
+use std::io::{self, copy, BufRead, BufReader, BufWriter, Read, Write};
 use std::iter::{repeat, IntoIterator};
 use std::mem;
-use std::num::NonZeroU32;
+use std::num::{NonZeroU32, NonZeroUsize};
 use std::os::raw::{c_char, c_int, c_ulong};
+use std::path::{Path, PathBuf};
 use std::process::{Command, Stdio};
 use std::ptr;
-use std::sync::Mutex;
+use std::sync::atomic::{AtomicUsize, Ordering as AtomicOrdering};
+use std::sync::{mpsc, Mutex, MutexGuard};
+use std::{cmp, thread};
 
 use bit_vec::BitVec;
 use bitflags::bitflags;
+use bstr::io::BufReadExt;
 use bstr::{BStr, BString, ByteSlice};
 use derive_more::Deref;
 use either::Either;
@@ -28,6 +33,7 @@ use itertools::EitherOrBoth::{Both, Left, Right};
 use itertools::Itertools;
 use percent_encoding::{percent_decode, percent_encode, NON_ALPHANUMERIC};
 use tee::TeeReader;
+use tempfile::NamedTempFile;
 use url::{Host, Url};
 
 use crate::cinnabar::{
@@ -47,12 +53,16 @@ use crate::hg_connect_http::HttpRequest;
 use crate::hg_data::{hash_data, GitAuthorship, HgAuthorship, HgCommitter};
 use crate::libcinnabar::{git_notes_tree, hg_notes_tree, strslice, strslice_mut, AsStrSlice};
 use crate::libgit::{
-    config_get_value, die, for_each_ref_in, get_oid_blob, object_entry, object_id, object_type,
-    resolve_ref, FfiBox, FileMode, RefTransaction,
+    config_get_value, die, for_each_ref_in, get_oid_blob, git_common_dir, git_object_info,
+    object_entry, object_id, object_type, resolve_ref, FfiBox, FileMode, ObjReadLock,
+    RefTransaction,
 };
 use crate::oid::ObjectId;
 use crate::progress::{progress_enabled, Progress};
-use crate::tree_util::{diff_by_path, merge_join_by_path, Empty, ParseTree, RecurseTree, WithPath};
+use crate::trace::Span;
+use crate::tree_util::{
+    diff_by_path, for_each_recursed, merge_join_by_path, Empty, ParseTree, RecurseTree, WithPath,
+};
 use crate::util::{
     FromBytes, ImmutBString, IteratorExt, OsStrExt, RcExt, RcSlice, RcSliceBuilder, ReadExt,
     SliceExt, ToBoxed, Transpose,
@@ -91,6 +101,8 @@ pub struct Store {
     manifest_heads_: OnceCell<RefCell<ManifestHeads>>,
     tree_cache_: RefCell<BTreeMap<GitManifestTreeId, TreeId>>,
     reverse_replace: RefCell<BTreeMap<GitChangesetId, GitChangesetId>>,
+    tags_cache_: OnceCell<RefCell<TagsCache>>,
+    legacy_checked_: OnceCell<()>,
 }
 
 impl Store {
@@ -110,6 +122,8 @@ impl Store {
             manifest_heads_: OnceCell::new(),
             tree_cache_: RefCell::new(BTreeMap::new()),
             reverse_replace: RefCell::new(BTreeMap::new()),
+            tags_cache_: OnceCell::new(),
+            legacy_checked_: OnceCell::new(),
         }
     }
 }
@@ -183,6 +197,107 @@ impl Store {
     }
 }
 
+/// Lookups in the metadata notes trees, which both `Store` and
+/// `StoreSnapshot` provide.
+pub trait MetadataLookup {
+    fn hg2git_note(&self, oid: HgObjectId) -> Option<GitObjectId>;
+    fn git2hg_note(&self, oid: GitObjectId) -> Option<GitObjectId>;
+    fn files_meta_note(&self, oid: HgObjectId) -> Option<GitObjectId>;
+}
+
+impl<T: MetadataLookup + ?Sized> MetadataLookup for &T {
+    fn hg2git_note(&self, oid: HgObjectId) -> Option<GitObjectId> {
+        (**self).hg2git_note(oid)
+    }
+
+    fn git2hg_note(&self, oid: GitObjectId) -> Option<GitObjectId> {
+        (**self).git2hg_note(oid)
+    }
+
+    fn files_meta_note(&self, oid: HgObjectId) -> Option<GitObjectId> {
+        (**self).files_meta_note(oid)
+    }
+}
+
+impl MetadataLookup for Store {
+    fn hg2git_note(&self, oid: HgObjectId) -> Option<GitObjectId> {
+        self.hg2git_mut().get_note(oid)
+    }
+
+    fn git2hg_note(&self, oid: GitObjectId) -> Option<GitObjectId> {
+        self.git2hg_mut().get_note(oid)
+    }
+
+    fn files_meta_note(&self, oid: HgObjectId) -> Option<GitObjectId> {
+        self.files_meta_mut().get_note(oid)
+    }
+}
+
+// Number of independent copies of each notes tree in a StoreSnapshot. Notes
+// trees are fanned out on the first byte of the object ids, so each copy
+// only ends up loading the subtrees for its share of them.
+const SNAPSHOT_STRIPES: usize = 16;
+
+struct StripedNotes<T>(Box<[Mutex<T>]>);
+
+impl<T> StripedNotes<T> {
+    fn new(f: impl Fn() -> T) -> Self {
+        StripedNotes((0..SNAPSHOT_STRIPES).map(|_| Mutex::new(f())).collect())
+    }
+
+    fn stripe<O: ObjectId>(&self, oid: &O) -> MutexGuard<T> {
+        let stripe = oid.as_raw_bytes()[0] as usize % SNAPSHOT_STRIPES;
+        self.0[stripe].lock().unwrap()
+    }
+}
+
+/// Read-only view of the metadata a `Store` was created from, usable from
+/// multiple threads at once.
+///
+/// Unlike the `Store`, it doesn't see metadata that hasn't been stored in
+/// the metadata commit yet. It must not be used while objects are being
+/// imported, because fast-import isn't thread-safe. Reading raw objects
+/// from other threads relies on git's object read lock, which is enabled
+/// for as long as a snapshot is alive. Raw objects and manifests read
+/// through it use the caches of the calling thread.
+pub struct StoreSnapshot {
+    hg2git: StripedNotes<hg_notes_tree>,
+    git2hg: StripedNotes<git_notes_tree>,
+    files_meta: StripedNotes<hg_notes_tree>,
+    _obj_read_lock: ObjReadLock,
+}
+
+// The notes trees are only ever accessed under their Mutex, and the C code
+// behind them has no global state, but the raw pointers they contain make
+// them neither Send nor Sync.
+unsafe impl Send for StoreSnapshot {}
+unsafe impl Sync for StoreSnapshot {}
+
+impl Store {
+    pub fn snapshot(&self) -> StoreSnapshot {
+        StoreSnapshot {
+            hg2git: StripedNotes::new(|| hg_notes_tree::new_with(self.hg2git_cid)),
+            git2hg: StripedNotes::new(|| git_notes_tree::new_with(self.git2hg_cid)),
+            files_meta: StripedNotes::new(|| hg_notes_tree::new_with(self.files_meta_cid)),
+            _obj_read_lock: ObjReadLock::new(),
+        }
+    }
+}
+
+impl MetadataLookup for StoreSnapshot {
+    fn hg2git_note(&self, oid: HgObjectId) -> Option<GitObjectId> {
+        self.hg2git.stripe(&oid).get_note(oid)
+    }
+
+    fn git2hg_note(&self, oid: GitObjectId) -> Option<GitObjectId> {
+        self.git2hg.stripe(&oid).get_note(oid)
+    }
+
+    fn files_meta_note(&self, oid: HgObjectId) -> Option<GitObjectId> {
+        self.files_meta.stripe(&oid).get_note(oid)
+    }
+}
+
 pub fn has_metadata(store: &Store) -> bool {
     !store.flags.is_empty()
 }
@@ -190,10 +305,9 @@ pub fn has_metadata(store: &Store) -> bool {
 macro_rules! hg2git {
     ($h:ident => $g:ident) => {
         impl $h {
-            pub fn to_git(self, store: &Store) -> Option<$g> {
+            pub fn to_git(self, store: &impl MetadataLookup) -> Option<$g> {
                 store
-                    .hg2git_mut()
-                    .get_note(self.into())
+                    .hg2git_note(self.into())
                     .map(|o| $g::from_raw_bytes(o.as_raw_bytes()).unwrap())
             }
         }
@@ -214,7 +328,7 @@ hg2git!(HgManifestId => GitManifestId);
 hg2git!(HgFileId => GitFileId);
 
 impl GitChangesetId {
-    pub fn to_hg(self, store: &Store) -> Option<HgChangesetId> {
+    pub fn to_hg(self, store: &impl MetadataLookup) -> Option<HgChangesetId> {
         //TODO: avoid repeatedly reading metadata for a given changeset.
         //The equivalent python code was keeping a LRU cache.
         let metadata = RawGitChangesetMetadata::read(store, self);
@@ -228,10 +342,9 @@ impl GitChangesetId {
 pub struct RawGitChangesetMetadata(RawBlob);
 
 impl RawGitChangesetMetadata {
-    pub fn read(store: &Store, changeset_id: GitChangesetId) -> Option<Self> {
+    pub fn read(store: &impl MetadataLookup, changeset_id: GitChangesetId) -> Option<Self> {
         let note = store
-            .git2hg_mut()
-            .get_note(CommitId::from(changeset_id).into())
+            .git2hg_note(CommitId::from(changeset_id).into())
             .map(BlobId::from_unchecked)?;
         RawBlob::read(note).map(Self)
     }
@@ -552,7 +665,7 @@ impl From<Vec<u8>> for RawHgChangeset {
 
 impl RawHgChangeset {
     pub fn from_metadata<B: AsRef<[u8]>>(
-        store: &Store,
+        store: &impl MetadataLookup,
         commit: &Commit,
         metadata: &GitChangesetMetadata<B>,
     ) -> Option<Self> {
@@ -560,7 +673,7 @@ impl RawHgChangeset {
     }
 
     fn from_metadata_<B: AsRef<[u8]>>(
-        store: &Store,
+        store: &impl MetadataLookup,
         commit: &Commit,
         metadata: &GitChangesetMetadata<B>,
         handle_changeset_conflict: bool,
@@ -640,7 +753,7 @@ impl RawHgChangeset {
         Some(RawHgChangeset(changeset.into()))
     }
 
-    pub fn read(store: &Store, oid: GitChangesetId) -> Option<Self> {
+    pub fn read(store: &impl MetadataLookup, oid: GitChangesetId) -> Option<Self> {
         let commit = RawCommit::read(oid.into())?;
         let commit = commit.parse()?;
         let metadata = RawGitChangesetMetadata::read(store, oid)?;
@@ -779,13 +892,13 @@ impl RawHgManifest {
                     };
                 }
             } else {
-                for entry in GitManifestTree::read(tree_id)
-                    .unwrap()
-                    .into_iter()
-                    .recurse()
-                {
-                    RawHgManifest::write_one_entry(&entry, &mut manifest).unwrap();
-                }
+                for_each_recursed(
+                    GitManifestTree::read(tree_id).unwrap().into_iter(),
+                    |path, entry| {
+                        RawHgManifest::write_one_entry_borrowed(path, &entry, &mut manifest)
+                            .unwrap();
+                    },
+                );
             }
             let content = manifest.into_rc();
 
@@ -818,13 +931,12 @@ impl RawHgFile {
         Some(Self(result.into_rc()))
     }
 
-    pub fn read_hg(store: &Store, oid: HgFileId) -> Option<Self> {
+    pub fn read_hg(store: &impl MetadataLookup, oid: HgFileId) -> Option<Self> {
         if oid == Self::EMPTY_OID {
             Some(Self(RcSlice::new()))
         } else {
             let metadata = store
-                .files_meta_mut()
-                .get_note(oid.into())
+                .files_meta_note(oid.into())
                 .map(BlobId::from_unchecked)
                 .map(GitFileMetadataId::from_unchecked);
             Self::read(oid.to_git(store).unwrap(), metadata)
@@ -1284,7 +1396,7 @@ impl ManifestHeads {
     }
 }
 
-#[derive(Default)]
+#[derive(Clone, Default)]
 pub struct TagSet {
     tags: IndexMap<Box<[u8]>, (HgChangesetId, HashSet<HgChangesetId>)>,
 }
@@ -1356,22 +1468,117 @@ impl PartialEq for TagSet {
     }
 }
 
+// Cache of the .hgtags blobs of the changeset heads, keyed by the git
+// commit for the head, such that finding the tags doesn't require looking
+// up trees for every head. The mapping is persisted in
+// $GIT_COMMON_DIR/cinnabar/hgtags-cache, one "<commit> <blob>" line per
+// head, with "-" as blob when there is no .hgtags file.
+// The merged tag set for the last set of .hgtags blobs is also kept around
+// for the duration of the process.
+#[derive(Default)]
+struct TagsCache {
+    hgtags: BTreeMap<GitChangesetId, Option<BlobId>>,
+    merged: Option<(Vec<BlobId>, TagSet)>,
+}
+
+impl TagsCache {
+    fn path() -> PathBuf {
+        git_common_dir().join("cinnabar").join("hgtags-cache")
+    }
+
+    fn load() -> Self {
+        let mut result = TagsCache::default();
+        if let Ok(file) = File::open(Self::path()) {
+            for line in BufReader::new(file).byte_lines() {
+                let Some((head, tags_file)) = line.ok().and_then(|line| {
+                    let [head, tags_file] = line.splitn_exact(b' ')?;
+                    let head = GitChangesetId::from_bytes(head).ok()?;
+                    let tags_file = match tags_file {
+                        b"-" => None,
+                        b => Some(BlobId::from_bytes(b).ok()?),
+                    };
+                    Some((head, tags_file))
+                }) else {
+                    // A broken cache is not fatal, it just needs to be rebuilt.
+                    result.hgtags.clear();
+                    break;
+                };
+                result.hgtags.insert(head, tags_file);
+            }
+        }
+        result
+    }
+
+    fn save(&self) -> io::Result<()> {
+        let path = Self::path();
+        let dir = path.parent().unwrap();
+        fs::create_dir_all(dir)?;
+        let mut file = NamedTempFile::new_in(dir)?;
+        {
+            let mut output = BufWriter::new(&mut file);
+            for (head, tags_file) in &self.hgtags {
+                match tags_file {
+                    Some(tags_file) => writeln!(output, "{} {}", head, tags_file)?,
+                    None => writeln!(output, "{} -", head)?,
+                }
+            }
+            output.flush()?;
+        }
+        file.persist(path).map_err(|e| e.error)?;
+        Ok(())
+    }
+}
+
 impl Store {
     pub fn get_tags(&self) -> TagSet {
-        let mut tags = TagSet::default();
-        let mut tags_files = HashSet::new();
+        let mut cache = self
+            .tags_cache_
+            .get_or_init(|| RefCell::new(TagsCache::load()))
+            .borrow_mut();
+        let cache = &mut *cache;
+        let mut hgtags = BTreeMap::new();
+        let mut tags_files = Vec::new();
+        let mut seen_tags_files = HashSet::new();
+        let mut changed = false;
         for head in self.changeset_heads().heads() {
-            (|| -> Option<()> {
-                let head = head.to_git(self)?;
-                let tags_file = get_oid_blob(format!("{}:.hgtags", head).as_bytes())?;
-                if tags_files.insert(tags_file) {
-                    let tags_blob = RawBlob::read(tags_file).unwrap();
-                    tags.merge(TagSet::from_buf(tags_blob.as_bytes())?);
+            let Some(head) = head.to_git(self) else {
+                continue;
+            };
+            let tags_file = *hgtags.entry(head).or_insert_with(|| {
+                cache.hgtags.remove(&head).unwrap_or_else(|| {
+                    changed = true;
+                    get_oid_blob(format!("{}:.hgtags", head).as_bytes())
+                })
+            });
+            if let Some(tags_file) = tags_file {
+                if seen_tags_files.insert(tags_file) {
+                    tags_files.push(tags_file);
                 }
-                Some(())
-            })();
+            }
+        }
+        // Anything left in the cache is for heads that are not heads anymore.
+        changed |= !cache.hgtags.is_empty();
+        cache.hgtags = hgtags;
+        if changed {
+            if let Err(e) = cache.save() {
+                debug!(target: "root", "Failed to write .hgtags cache: {}", e);
+            }
+        }
+
+        match &cache.merged {
+            Some((merged_files, tags)) if *merged_files == tags_files => tags.clone(),
+            _ => {
+                let mut tags = TagSet::default();
+                for tags_file in &tags_files {
+                    let tags_blob = RawBlob::read(*tags_file).unwrap();
+                    if let Some(t) = TagSet::from_buf(tags_blob.as_bytes()) {
+                        tags.merge(t);
+                    }
+                }
+                cache.merged = Some((tags_files, tags.clone()));
+                tags
+            }
         }
-        tags
     }
 }
 
@@ -1451,6 +1658,7 @@ extern "C" {
     pub fn do_set_replace(replaced: *const object_id, replace_with: *const object_id);
     fn get_object_entry(oid: *const object_id) -> *const object_entry;
     fn unpack_object_entry(oe: *const object_entry, buf: *mut *mut c_char, len: *mut c_ulong);
+    fn stream_git_blob(path: *const c_char, result: *mut object_id);
 }
 
 pub fn store_git_blob(blob_buf: &[u8]) -> BlobId {
@@ -1467,6 +1675,33 @@ pub fn store_git_blob(blob_buf: &[u8]) -> BlobId {
     }
 }
 
+// Like store_git_blob, for the contents of a file, without reading it all
+// in memory.
+pub fn store_git_blob_file(path: &Path) -> io::Result<BlobId> {
+    let mut file = File::open(path)?;
+    let len = file.metadata()?.len();
+    // fast-import can't stream a blob it already has, so check first.
+    let mut hash = BlobId::create();
+    hash.update(format!("blob {len}\0"));
+    let mut buf = vec![0; 65536];
+    loop {
+        match file.read(&mut buf)? {
+            0 => break,
+            n => hash.update(&buf[..n]),
+        }
+    }
+    let blob_id = hash.finalize();
+    if git_object_info(blob_id, false).is_none() {
+        let path = path.as_os_str().to_cstring();
+        let mut result = object_id::default();
+        unsafe {
+            stream_git_blob(path.as_ptr(), &mut result);
+        }
+        assert_eq!(blob_id, BlobId::from_unchecked(result.into()));
+    }
+    Ok(blob_id)
+}
+
 pub fn store_git_tree(tree_buf: &[u8], reference: Option<TreeId>) -> TreeId {
     unsafe {
         let mut oe = ptr::null();
@@ -1604,11 +1839,19 @@ fn create_git_tree(
     let merge_tree = merge_tree_id.map_or(GitManifestTree::EMPTY, |tid| {
         GitManifestTree::read(tid).unwrap()
     });
+    let ref_tree = ref_tree_id.map(|tid| RawTree::read(tid).unwrap());
     let mut tree_buf = Vec::with_capacity(manifest_tree.as_ref().len());
-    let mut ref_tree = None;
-    for (path, entries) in
-        merge_join_by_path(manifest_tree.iter(), merge_tree.iter()).map(WithPath::unzip)
+    // All three trees are sorted the same way, so the entries from the
+    // reference tree are found by walking along the manifest tree.
+    for (path, (entries, ref_entry)) in merge_join_by_path(
+        merge_join_by_path(manifest_tree.iter(), merge_tree.iter()),
+        ref_tree.into_iter().flatten(),
+    )
+    .map(|item| item.map(|entries| entries.left_and_right()).unzip())
     {
+        let Some(entries) = entries else {
+            continue;
+        };
         let entry = entries
             .as_ref()
             .left()
@@ -1645,25 +1888,16 @@ fn create_git_tree(
             return result;
         }
         let (oid, mode): (GitObjectId, _) = match entry {
-            Either::Left(subtree_id) => {
-                let ref_entry_oid = ref_tree_id
-                    .and_then(|tid| {
-                        ref_tree
-                            .get_or_insert_with(|| RawTree::read(tid).unwrap().into_iter())
-                            .find(|e| e.path() == path.as_bstr())
-                    })
-                    .and_then(|e| e.into_inner().left());
-                (
-                    create_git_tree(
-                        store,
-                        *subtree_id,
-                        ref_entry_oid,
-                        entries.right().and_then(Either::left),
-                    )
-                    .into(),
-                    FileMode::DIRECTORY,
+            Either::Left(subtree_id) => (
+                create_git_tree(
+                    store,
+                    *subtree_id,
+                    ref_entry.and_then(Either::left),
+                    entries.right().and_then(Either::left),
                 )
-            }
+                .into(),
+                FileMode::DIRECTORY,
+            ),
             Either::Right(entry) => {
                 let oid = if entry.fid == RawHgFile::EMPTY_OID {
                     let empty_blob_id = store_git_blob(&[]);
@@ -1731,7 +1965,9 @@ fn store_changeset(
         ref_commit.tree()
     });
 
+    let span = Span::new("import", "create_git_tree");
     let tree_id = create_git_tree(store, manifest_tree_id, ref_tree, None);
+    drop(span);
 
     let (commit_id, metadata_id, transition) =
         match graft(store, changeset_id, raw_changeset, tree_id, &git_parents) {
@@ -1995,26 +2231,54 @@ pub unsafe extern "C" fn check_manifest(oid: *const object_id) -> c_int {
 
 static STORED_FILES: Mutex<BTreeMap<HgFileId, [HgFileId; 2]>> = Mutex::new(BTreeMap::new());
 
-pub fn check_file(store: &Store, node: HgFileId, p1: HgFileId, p2: HgFileId) -> bool {
+pub fn check_file(store: &impl MetadataLookup, node: HgFileId, p1: HgFileId, p2: HgFileId) -> bool {
     let data = RawHgFile::read_hg(store, node).unwrap();
     crate::hg_data::find_file_parents(node, Some(p1), Some(p2), &data).is_some()
 }
 
 pub fn do_check_files(store: &Store) -> bool {
     // Try to detect issue #207 as early as possible.
-    let mut busted = false;
-    for (&node, &[p1, p2]) in STORED_FILES
+    let files = STORED_FILES
         .lock()
         .unwrap()
         .iter()
-        .progress(|n| format!("Checking {n} imported file root and head revisions"))
-    {
-        if !check_file(store, node, p1, p2) {
-            error!(target: "root", "Error in file {node}");
-            busted = true;
+        .map(|(&node, &parents)| (node, parents))
+        .collect_vec();
+    // Each file is checked independently, so spread them across threads.
+    let snapshot = store.snapshot();
+    let next_file = AtomicUsize::new(0);
+    let threads = thread::available_parallelism().map_or(1, NonZeroUsize::get);
+    let mut busted = thread::scope(|s| {
+        let (sender, receiver) = mpsc::channel();
+        for _ in 0..cmp::min(threads, files.len()) {
+            let sender = sender.clone();
+            let (files, snapshot, next_file) = (&files, &snapshot, &next_file);
+            thread::Builder::new()
+                .name("check-files".into())
+                .spawn_scoped(s, move || {
+                    while let Some(&(node, [p1, p2])) =
+                        files.get(next_file.fetch_add(1, AtomicOrdering::Relaxed))
+                    {
+                        sender
+                            .send((node, check_file(snapshot, node, p1, p2)))
+                            .unwrap();
+                    }
+                })
+                .unwrap();
         }
+        drop(sender);
+        receiver
+            .into_iter()
+            .progress(|n| format!("Checking {n} imported file root and head revisions"))
+            .filter_map(|(node, ok)| (!ok).then_some(node))
+            .collect_vec()
+    });
+    drop(snapshot);
+    busted.sort();
+    for node in &busted {
+        error!(target: "root", "Error in file {node}");
     }
-    if busted {
+    if !busted.is_empty() {
         let mut transaction = RefTransaction::new().unwrap();
         transaction
             .update(BROKEN_REF, store.metadata_cid, None, "post-pull check")
@@ -2036,32 +2300,41 @@ pub fn do_check_files(store: &Store) -> bool {
              repository."
         );
     }
-    !busted
+    busted.is_empty()
 }
 
 pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
     unsafe {
         ensure_store_init();
     }
-    let mut bundle = Vec::new();
+    // The re-encoded bundle can be as large as the changegroup, so it is
+    // spooled to disk rather than kept in memory.
+    let mut bundle = None;
     let mut bundle_writer = None;
-    let mut input =
-        if check_enabled(Checks::UNBUNDLER) && store.changeset_heads().heads().next().is_some() {
-            bundle_writer = Some(BundleWriter::new(BundleSpec::V2Zstd, &mut bundle).unwrap());
-            let bundle_writer = bundle_writer.as_mut().unwrap();
-            let info = BundlePartInfo::new(0, "changegroup")
-                .set_param("version", &format!("{:02}", version));
-            let part = bundle_writer.new_part(info).unwrap();
-            Box::new(TeeReader::new(input, part)) as Box<dyn Read>
-        } else {
-            Box::from(input)
-        };
+    let mut input = if check_enabled(Checks::UNBUNDLER)
+        && store.changeset_heads().heads().next().is_some()
+    {
+        let bundle = bundle.insert(NamedTempFile::new_in(git_common_dir()).unwrap());
+        bundle_writer =
+            Some(BundleWriter::new(BundleSpec::V2Zstd, BufWriter::new(bundle.as_file())).unwrap());
+        let bundle_writer = bundle_writer.as_mut().unwrap();
+        let info =
+            BundlePartInfo::new(0, "changegroup").set_param("version", &format!("{:02}", version));
+        let part = bundle_writer.new_part(info).unwrap();
+        Box::new(TeeReader::new(input, part)) as Box<dyn Read>
+    } else {
+        Box::from(input)
+    };
+    let span = Span::new("import", "read changesets");
     let mut changesets = RevChunkIter::new(version, &mut input)
         .progress(|n| format!("Reading {n} changesets"))
         .collect_vec();
+    drop(span);
+    let mut span = Span::new("import", "import manifests");
     for manifest in RevChunkIter::new(version, &mut input)
         .progress(|n| format!("Reading and importing {n} manifests"))
     {
+        span.add("manifests", 1);
         let mid = HgManifestId::from_unchecked(manifest.node());
         let delta_node = HgManifestId::from_unchecked(manifest.delta_node());
         let reference_mn = if delta_node.is_null() {
@@ -2085,6 +2358,8 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
         mn_size += reference_mn.len() - last_end;
 
         let mut stored_manifest = RcSlice::builder_with_capacity(mn_size);
+        let mut manifest_span = Span::new("import", "store_manifest");
+        manifest_span.add("bytes", mn_size as u64);
         unsafe {
             store_manifest(
                 store,
@@ -2094,6 +2369,7 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
             );
             stored_manifest.set_len(mn_size);
         }
+        drop(manifest_span);
 
         let tree_id = mid.to_git(store).unwrap().get_tree_id();
         MANIFESTCACHE.with(|cache| {
@@ -2103,6 +2379,8 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
             }));
         });
     }
+    drop(span);
+    let mut span = Span::new("import", "import files");
     let files = Cell::new(0);
     let mut progress = repeat(()).progress(|n| {
         format!(
@@ -2155,11 +2433,12 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
                 // with here.
                 continue;
             }
-            let reference_file = previous_file
-                .take()
-                .and_then(|(fid, file)| (fid == delta_node).then_some(file))
-                .unwrap_or_else(|| {
-                    RawHgFile::read_hg(
+            let previous = previous_file.take();
+            let read_reference_file;
+            let reference_file = match &previous {
+                Some((fid, file, _)) if *fid == delta_node => file,
+                _ => {
+                    read_reference_file = RawHgFile::read_hg(
                         store,
                         if delta_node.is_null() {
                             RawHgFile::EMPTY_OID
@@ -2167,22 +2446,34 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
                             delta_node
                         },
                     )
-                    .unwrap()
-                });
+                    .unwrap();
+                    &read_reference_file
+                }
+            };
 
-            let mut raw_file = RcSliceBuilder::new();
+            // Validate the diff and compute the size of the resulting file
+            // first, so that it can be built in a single allocation.
+            let mut size = 0;
             let mut last_end = 0;
             for diff in file.iter_diff() {
                 if diff.start() > reference_file.len() || diff.start() < last_end {
                     die!("Malformed file chunk for {node}");
                 }
-                raw_file.extend_from_slice(&reference_file[last_end..diff.start()]);
-                raw_file.extend_from_slice(diff.data());
+                size += diff.start() - last_end + diff.data().len();
                 last_end = diff.end();
             }
             if reference_file.len() < last_end {
                 die!("Malformed file chunk for {node}");
             }
+            size += reference_file.len() - last_end;
+
+            let mut raw_file = RcSliceBuilder::with_capacity(size);
+            let mut last_end = 0;
+            for diff in file.iter_diff() {
+                raw_file.extend_from_slice(&reference_file[last_end..diff.start()]);
+                raw_file.extend_from_slice(diff.data());
+                last_end = diff.end();
+            }
             raw_file.extend_from_slice(&reference_file[last_end..]);
             let mut content = &raw_file[..];
             if content.starts_with(b"\x01\n") {
@@ -2194,27 +2485,39 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
                     .add_note(node.into(), metadata_oid.into());
                 content = file_content;
             }
-            unsafe {
-                let file_oid = if let Some(reference_entry) = (!delta_node.is_null())
-                    .then(|| {
-                        delta_node.to_git(store).and_then(|delta_node| {
-                            get_object_entry(&GitObjectId::from(delta_node).into()).as_ref()
-                        })
-                    })
-                    .flatten()
-                {
+            let content_offset = raw_file.len() - content.len();
+            // Git deltas can only be made against objects in the pack being
+            // written. When the mercurial delta base is not in there, fall
+            // back to the previous revision of the same file in this
+            // changegroup, which is likely to be similar.
+            let current_pack_entry = |fid: HgFileId| {
+                fid.to_git(store).and_then(|bid| unsafe {
+                    get_object_entry(&GitObjectId::from(bid).into()).as_ref()
+                })
+            };
+            let reference = (!delta_node.is_null())
+                .then(|| current_pack_entry(delta_node))
+                .flatten()
+                .map(|reference_entry| {
                     let reference_offset = store
                         .files_meta_mut()
                         .get_note(delta_node.into())
                         .map(BlobId::from_unchecked)
                         .map_or(0, |b| RawBlob::read(b).unwrap().as_bytes().len() + 4);
-
+                    (&reference_file[reference_offset..], reference_entry)
+                })
+                .or_else(|| {
+                    let (fid, file, offset) = previous.as_ref()?;
+                    current_pack_entry(*fid).map(|entry| (&file[*offset..], entry))
+                });
+            unsafe {
+                let file_oid = if let Some((reference, reference_entry)) = reference {
                     let mut file_oid = object_id::default();
                     store_git_object(
                         object_type::OBJ_BLOB,
                         content.as_str_slice(),
                         &mut file_oid,
-                        &reference_file[reference_offset..].as_str_slice(),
+                        &reference.as_str_slice(),
                         reference_entry,
                     );
                     BlobId::from_unchecked(file_oid.into())
@@ -2223,10 +2526,14 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
                 };
                 store.hg2git_mut().add_note(node.into(), file_oid.into());
             }
-            previous_file = Some((node, RawHgFile(raw_file.into_rc())));
+            span.add("bytes", raw_file.len() as u64);
+            previous_file = Some((node, RawHgFile(raw_file.into_rc()), content_offset));
         }
     }
     drop(progress);
+    span.add("files", files.get());
+    drop(span);
+    let mut span = Span::new("import", "import changesets");
 
     let mut previous = (HgChangesetId::NULL, RawHgChangeset(Box::new([])));
     for changeset in changesets
@@ -2278,12 +2585,15 @@ pub fn store_changegroup<R: Read>(store: &Store, input: R, version: u8) {
                 itertools::join(candidates.iter(), ", ")
             ),
         }
+        span.add("changesets", 1);
         previous = (changeset_id, raw_changeset);
     }
+    drop(span);
     drop(input);
     drop(bundle_writer);
-    if !bundle.is_empty() {
-        let bundle_blob = store_git_blob(&bundle);
+    if let Some(bundle) = bundle {
+        let _span = Span::new("import", "store bundle");
+        let bundle_blob = store_git_blob_file(bundle.path()).unwrap();
         BUNDLE_BLOBS.lock().unwrap().push(bundle_blob);
     }
 }
@@ -2653,21 +2963,17 @@ impl Store {
         {
             old_metadata();
         }
-        let mut count = 0;
-        for_each_ref_in("refs/cinnabar/branches/", |_, _| -> Result<(), ()> {
-            count += 1;
-            Ok(())
-        })
-        .ok();
-        if count > 0 {
-            old_metadata();
-        }
-
         unsafe {
             reset_replace_map();
         }
 
-        let tree = RawTree::read(c.tree()).unwrap();
+        // Without grafts, the replace map is the empty tree, and there is
+        // nothing to read.
+        let tree = if c.tree() == RawTree::EMPTY_OID {
+            RawTree::EMPTY
+        } else {
+            RawTree::read(c.tree()).unwrap()
+        };
         let mut replaces = BTreeMap::new();
         for (path, oid) in tree.into_iter().map(WithPath::unzip) {
             match oid {
@@ -2701,27 +3007,37 @@ impl Store {
                 );
             }
         }
-        if unsafe { replace_map_tablesize() } == 0 {
-            let mut count = 0;
-            for_each_ref_in(REPLACE_REFS_PREFIX, |_, _| -> Result<(), ()> {
-                count += 1;
-                Ok(())
-            })
-            .ok();
-            if count > 0 {
+        result
+    }
+
+    // Checks for leftovers of metadata from older versions that aren't
+    // visible in the metadata commit itself. This requires scanning refs, so
+    // it is only done once, and only by callers that are about to modify the
+    // metadata, so that read-only commands start faster.
+    pub fn check_legacy_metadata(&self) {
+        if self.metadata_cid.is_null() {
+            return;
+        }
+        self.legacy_checked_.get_or_init(|| {
+            let any_ref_in = |prefix: &str| {
+                for_each_ref_in(prefix, |_, _| -> Result<(), ()> { Err(()) }).is_err()
+            };
+            if any_ref_in("refs/cinnabar/branches/") {
                 old_metadata();
             }
-        }
-        // Delete new-type tag_cache, we don't use it anymore. Old-type
-        // tag-cache is expected to have been removed by versions >= 0.5.x,
-        // which is a required first step if upgrading from < 0.5.0.
-        let tag_cache = "refs/cinnabar/tag_cache";
-        if let Some(cid) = resolve_ref(tag_cache) {
-            let mut transaction = RefTransaction::new().unwrap();
-            transaction.delete(tag_cache, Some(cid), "cleanup").unwrap();
-            transaction.commit().unwrap();
-        }
-        result
+            if unsafe { replace_map_tablesize() } == 0 && any_ref_in(REPLACE_REFS_PREFIX) {
+                old_metadata();
+            }
+            // Delete new-type tag_cache, we don't use it anymore. Old-type
+            // tag-cache is expected to have been removed by versions >= 0.5.x,
+            // which is a required first step if upgrading from < 0.5.0.
+            let tag_cache = "refs/cinnabar/tag_cache";
+            if let Some(cid) = resolve_ref(tag_cache) {
+                let mut transaction = RefTransaction::new().unwrap();
+                transaction.delete(tag_cache, Some(cid), "cleanup").unwrap();
+                transaction.commit().unwrap();
+            }
+        });
     }
 }
 
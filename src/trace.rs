@@ -0,0 +1,242 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+//! Timeline of what the various threads are doing, in the Chrome
+//! trace-event format, which chrome://tracing and https://ui.perfetto.dev
+//! can load.
+//!
+//! Enabled with the `cinnabar.trace` configuration (or `GIT_CINNABAR_TRACE`
+//! environment variable), set to the path of the file to write to. `%p` in
+//! the path is replaced with the process id. Several processes may write to
+//! the same file: events are appended, and carry their process id and an
+//! absolute timestamp.
+
+use std::borrow::Cow;
+use std::cell::Cell;
+use std::ffi::CStr;
+use std::fmt::Write as _;
+use std::fs::{File, OpenOptions};
+use std::io::ErrorKind;
+use std::io::Write;
+use std::os::raw::c_char;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::thread;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use once_cell::sync::OnceCell;
+
+use crate::get_config;
+
+struct Tracer {
+    file: File,
+    start_time: Instant,
+    // Time between the unix epoch and `start_time`.
+    epoch_offset: Duration,
+    next_thread_id: AtomicU64,
+}
+
+static TRACER: OnceCell<Tracer> = OnceCell::new();
+
+pub fn init(start_time: Instant) {
+    let Some(path) = get_config("trace") else {
+        return;
+    };
+    let path = match path.to_str() {
+        Some(p) => p.replace("%p", &std::process::id().to_string()).into(),
+        None => path,
+    };
+    let path = Path::new(&path);
+    // Whoever creates the file starts the JSON array. It is never closed,
+    // which viewers accept, so that other processes can keep appending.
+    let file = match OpenOptions::new().append(true).create_new(true).open(path) {
+        Ok(mut file) => file.write_all(b"[\n").map(|()| file),
+        Err(e) if e.kind() == ErrorKind::AlreadyExists => {
+            OpenOptions::new().append(true).open(path)
+        }
+        Err(e) => Err(e),
+    };
+    match file {
+        Ok(file) => {
+            TRACER.get_or_init(|| Tracer {
+                file,
+                start_time,
+                epoch_offset: SystemTime::now()
+                    .duration_since(UNIX_EPOCH)
+                    .unwrap_or_default()
+                    .saturating_sub(start_time.elapsed()),
+                next_thread_id: AtomicU64::new(1),
+            });
+        }
+        Err(e) => warn!(target: "root", "Cannot open {}: {}", path.display(), e),
+    }
+}
+
+impl Tracer {
+    fn write_event(&self, event: &str) {
+        // Each event is written in one go, in append mode, so that events
+        // from different threads or processes don't get mixed up, and a
+        // trace cut short by a die() is still usable.
+        (&self.file)
+            .write_all(format!("{event},\n").as_bytes())
+            .ok();
+    }
+
+    // Returns the process id and thread id to use for events of the
+    // current thread.
+    fn thread_id(&self) -> (u32, u64) {
+        thread_local! {
+            static THREAD_ID: Cell<(u32, u64)> = const { Cell::new((0, 0)) };
+        }
+        THREAD_ID.with(|id| {
+            // Forked processes inherit the thread id of the thread that
+            // forked, but need their own thread_name event.
+            let pid = std::process::id();
+            if id.get().0 != pid {
+                id.set((pid, self.next_thread_id.fetch_add(1, Ordering::Relaxed)));
+                let mut event = String::new();
+                write!(
+                    event,
+                    r#"{{"name":"thread_name","ph":"M","pid":{},"tid":{},"args":{{"name":"#,
+                    pid,
+                    id.get().1
+                )
+                .unwrap();
+                write_json_string(&mut event, thread::current().name().unwrap_or("unnamed"));
+                event.push_str("}}");
+                self.write_event(&event);
+            }
+            id.get()
+        })
+    }
+}
+
+fn write_json_string(out: &mut String, s: &str) {
+    out.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            '\n' => out.push_str("\\n"),
+            c if c < ' ' => write!(out, "\\u{:04x}", c as u32).unwrap(),
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+}
+
+#[test]
+fn test_write_json_string() {
+    let mut out = String::new();
+    write_json_string(&mut out, "foo \"bar\"\\\n\x01é");
+    assert_eq!(out, r#""foo \"bar\"\\\n\u0001é""#);
+}
+
+enum SpanArg {
+    Count(u64),
+    Text(String),
+}
+
+struct SpanData {
+    name: String,
+    category: &'static str,
+    start: Duration,
+    args: Vec<(&'static str, SpanArg)>,
+}
+
+/// A span of time on the current thread, recorded when dropped. Does
+/// nothing when tracing is disabled.
+pub struct Span(Option<SpanData>);
+
+impl Span {
+    pub fn new<'a>(category: &'static str, name: impl Into<Cow<'a, str>>) -> Self {
+        Span(TRACER.get().map(|tracer| SpanData {
+            name: name.into().into_owned(),
+            category,
+            start: tracer.start_time.elapsed(),
+            args: Vec::new(),
+        }))
+    }
+
+    pub fn is_enabled(&self) -> bool {
+        self.0.is_some()
+    }
+
+    /// Add to a counter (e.g. of bytes) attached to the span.
+    pub fn add(&mut self, name: &'static str, value: u64) {
+        if let Some(data) = &mut self.0 {
+            match data.args.iter_mut().find(|(n, _)| *n == name) {
+                Some((_, SpanArg::Count(count))) => *count += value,
+                Some((_, arg)) => *arg = SpanArg::Count(value),
+                None => data.args.push((name, SpanArg::Count(value))),
+            }
+        }
+    }
+
+    /// Attach some text to the span.
+    pub fn set_text(&mut self, name: &'static str, value: impl Into<String>) {
+        if let Some(data) = &mut self.0 {
+            data.args.push((name, SpanArg::Text(value.into())));
+        }
+    }
+}
+
+impl Drop for Span {
+    fn drop(&mut self) {
+        let (Some(data), Some(tracer)) = (self.0.take(), TRACER.get()) else {
+            return;
+        };
+        let end = tracer.start_time.elapsed();
+        let (pid, tid) = tracer.thread_id();
+        let mut event = String::new();
+        event.push_str(r#"{"name":"#);
+        write_json_string(&mut event, &data.name);
+        write!(
+            event,
+            r#","cat":"{}","ph":"X","ts":{:.3},"dur":{:.3},"pid":{},"tid":{}"#,
+            data.category,
+            (tracer.epoch_offset + data.start).as_secs_f64() * 1e6,
+            (end - data.start).as_secs_f64() * 1e6,
+            pid,
+            tid,
+        )
+        .unwrap();
+        if !data.args.is_empty() {
+            event.push_str(r#","args":{"#);
+            for (n, (name, arg)) in data.args.iter().enumerate() {
+                if n > 0 {
+                    event.push(',');
+                }
+                write_json_string(&mut event, name);
+                event.push(':');
+                match arg {
+                    SpanArg::Count(count) => write!(event, "{count}").unwrap(),
+                    SpanArg::Text(text) => write_json_string(&mut event, text),
+                }
+            }
+            event.push('}');
+        }
+        event.push('}');
+        tracer.write_event(&event);
+    }
+}
+
+#[allow(non_camel_case_types)]
+pub struct trace_span(Span);
+
+#[no_mangle]
+pub unsafe extern "C" fn trace_span_begin(name: *const c_char) -> *mut trace_span {
+    if TRACER.get().is_none() {
+        return std::ptr::null_mut();
+    }
+    let name = CStr::from_ptr(name).to_string_lossy();
+    Box::into_raw(Box::new(trace_span(Span::new("git", name))))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn trace_span_end(span: *mut trace_span) {
+    if !span.is_null() {
+        drop(Box::from_raw(span));
+    }
+}
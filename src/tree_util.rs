@@ -291,14 +291,32 @@ pub trait ParseTree: AsRef<[u8]> {
     /// Parsing error.
     type Error: std::fmt::Debug;
 
+    /// Parse one entry from the given buffer, returning its path as a slice
+    /// of the buffer.
+    ///
+    /// The method reads one entry, and advances `buf` to the beginning of
+    /// next entry.
+    fn parse_one_entry_borrowed<'a>(
+        buf: &mut &'a [u8],
+    ) -> Result<(&'a BStr, Self::Inner), Self::Error>;
+
     /// Parse one entry from the given buffer.
     ///
     /// The method is called by [`TreeIter`]. The method reads one entry, and
     /// advances `buf` to the beginning of next entry.
-    fn parse_one_entry(buf: &mut &[u8]) -> Result<WithPath<Self::Inner>, Self::Error>;
+    fn parse_one_entry(buf: &mut &[u8]) -> Result<WithPath<Self::Inner>, Self::Error> {
+        let (path, inner) = Self::parse_one_entry_borrowed(buf)?;
+        Ok(WithPath::new(path.as_bytes(), inner))
+    }
+
+    /// Write one entry with the given path into the given buffer.
+    fn write_one_entry_borrowed<W: Write>(path: &BStr, inner: &Self::Inner, w: W)
+        -> io::Result<()>;
 
     /// Write one entry into the given buffer.
-    fn write_one_entry<W: Write>(entry: &WithPath<Self::Inner>, w: W) -> io::Result<()>;
+    fn write_one_entry<W: Write>(entry: &WithPath<Self::Inner>, w: W) -> io::Result<()> {
+        Self::write_one_entry_borrowed(entry.path(), entry.inner(), w)
+    }
 
     /// Iterates the tree
     fn iter(&self) -> TreeIter<&Self> {
@@ -310,10 +328,24 @@ impl<T: ParseTree + ?Sized> ParseTree for &T {
     type Inner = T::Inner;
     type Error = T::Error;
 
+    fn parse_one_entry_borrowed<'a>(
+        buf: &mut &'a [u8],
+    ) -> Result<(&'a BStr, Self::Inner), Self::Error> {
+        T::parse_one_entry_borrowed(buf)
+    }
+
     fn parse_one_entry(buf: &mut &[u8]) -> Result<WithPath<Self::Inner>, Self::Error> {
         T::parse_one_entry(buf)
     }
 
+    fn write_one_entry_borrowed<W: Write>(
+        path: &BStr,
+        inner: &Self::Inner,
+        w: W,
+    ) -> io::Result<()> {
+        T::write_one_entry_borrowed(path, inner, w)
+    }
+
     fn write_one_entry<W: Write>(entry: &WithPath<Self::Inner>, w: W) -> io::Result<()> {
         T::write_one_entry(entry, w)
     }
@@ -332,6 +364,17 @@ impl<T: ParseTree> TreeIter<T> {
         let remaining = t.as_ref().len();
         TreeIter { tree: t, remaining }
     }
+
+    /// Calls a closure on each remaining entry, with its path borrowed from
+    /// the tree buffer, avoiding the allocation of a [`WithPath`] per entry.
+    pub fn for_each_borrowed<F: FnMut(&BStr, T::Inner)>(self, mut f: F) {
+        let buf = self.tree.as_ref();
+        let mut buf = &buf[buf.len() - self.remaining..];
+        while !buf.is_empty() {
+            let (path, inner) = T::parse_one_entry_borrowed(&mut buf).unwrap();
+            f(path, inner);
+        }
+    }
 }
 
 impl<T: ParseTree> Iterator for TreeIter<T> {
@@ -638,10 +681,16 @@ where
                             self.prefix.extend_from_slice(&path);
                             self.prefix.push(b'/');
                         }
+                        Either::Right(entry) if self.prefix.is_empty() => {
+                            return Some(WithPath::new(path, entry));
+                        }
                         Either::Right(entry) => {
-                            let mut full_path = self.prefix.clone();
+                            // Allocate the full path with its final size
+                            // directly.
+                            let mut full_path = Vec::with_capacity(self.prefix.len() + path.len());
+                            full_path.extend_from_slice(&self.prefix);
                             full_path.extend_from_slice(&path);
-                            return Some(WithPath::new(Vec::from(full_path), entry));
+                            return Some(WithPath::new(full_path, entry));
                         }
                     }
                 } else {
@@ -655,6 +704,125 @@ where
     }
 }
 
+/// Calls a closure on each non-tree entry of the given tree iterator,
+/// recursing into trees.
+///
+/// This is equivalent to `iter.recurse().for_each(...)`, except that
+/// no allocation happens for each entry: paths are borrowed from the tree
+/// buffers, and full paths are built in a single buffer that is reused
+/// during the whole recursion.
+pub fn for_each_recursed<T: ParseTree, F>(iter: TreeIter<T>, mut f: F)
+where
+    T::Inner: RecurseAs<TreeIter<T>>,
+    F: FnMut(&BStr, <T::Inner as RecurseAs<TreeIter<T>>>::NonRecursed),
+{
+    fn for_each_recursed_inner<T: ParseTree, F>(iter: TreeIter<T>, prefix: &mut BString, f: &mut F)
+    where
+        T::Inner: RecurseAs<TreeIter<T>>,
+        F: FnMut(&BStr, <T::Inner as RecurseAs<TreeIter<T>>>::NonRecursed),
+    {
+        iter.for_each_borrowed(|path, entry| {
+            let prefix_len = prefix.len();
+            prefix.extend_from_slice(path);
+            match entry.maybe_recurse() {
+                Either::Left(recursed) => {
+                    prefix.push(b'/');
+                    for_each_recursed_inner(recursed, prefix, f);
+                }
+                Either::Right(entry) => f(prefix.as_bstr(), entry),
+            }
+            prefix.truncate(prefix_len);
+        });
+    }
+
+    for_each_recursed_inner(iter, &mut BString::from(Vec::new()), &mut f);
+}
+
+#[test]
+fn test_for_each_recursed() {
+    use itertools::Itertools;
+
+    // Simple tree format where each entry is `<name>\0<kind><n>\n`, where
+    // `<kind>` is `t` for a tree, `<n>` being its index in `TREES`, or `f`
+    // for a file, `<n>` being its contents.
+    const TREES: [&[u8]; 3] = [
+        b"bar\0f0\nfoo\0t1\nqux\0f1\n",
+        b"a\0f2\nb\0t2\n",
+        b"c\0f3\n",
+    ];
+
+    struct Tree(&'static [u8]);
+
+    impl AsRef<[u8]> for Tree {
+        fn as_ref(&self) -> &[u8] {
+            self.0
+        }
+    }
+
+    enum Entry {
+        Tree(usize),
+        File(u8),
+    }
+
+    impl MayRecurse for Entry {
+        fn may_recurse(&self) -> bool {
+            matches!(self, Entry::Tree(_))
+        }
+    }
+
+    impl ParseTree for Tree {
+        type Inner = Entry;
+        type Error = ();
+
+        fn parse_one_entry_borrowed<'a>(buf: &mut &'a [u8]) -> Result<(&'a BStr, Entry), ()> {
+            let (path, remainder) = buf.split_at(buf.find_byte(b'\0').ok_or(())?);
+            let entry = match remainder.get(1..3) {
+                Some([b't', n]) => Entry::Tree((n - b'0').into()),
+                Some([b'f', n]) => Entry::File(n - b'0'),
+                _ => return Err(()),
+            };
+            *buf = &remainder[4..];
+            Ok((path.as_bstr(), entry))
+        }
+
+        fn write_one_entry_borrowed<W: Write>(
+            _path: &BStr,
+            _inner: &Entry,
+            _w: W,
+        ) -> io::Result<()> {
+            unimplemented!()
+        }
+    }
+
+    impl RecurseAs<TreeIter<Tree>> for Entry {
+        type NonRecursed = u8;
+
+        fn maybe_recurse(self) -> Either<TreeIter<Tree>, u8> {
+            match self {
+                Entry::Tree(n) => Either::Left(TreeIter::new(Tree(TREES[n]))),
+                Entry::File(f) => Either::Right(f),
+            }
+        }
+    }
+
+    let recursed = TreeIter::new(Tree(TREES[0])).recurse().collect_vec();
+    assert_eq!(
+        &recursed,
+        &[
+            WithPath::new(*b"bar", 0),
+            WithPath::new(*b"foo/a", 2),
+            WithPath::new(*b"foo/b/c", 3),
+            WithPath::new(*b"qux", 1),
+        ]
+    );
+
+    let mut borrowed_recursed = Vec::new();
+    for_each_recursed(TreeIter::new(Tree(TREES[0])), |path, f| {
+        borrowed_recursed.push(WithPath::new(path.as_bytes(), f));
+    });
+    assert_eq!(borrowed_recursed, recursed);
+}
+
 #[allow(missing_docs)]
 pub trait Mergeish {
     type I: Iterator;
@@ -458,18 +458,36 @@ pub trait Transpose {
     fn transpose(self) -> Self::Target;
 }
 
+// Number of allocations kept around for reuse. The import loop juggles a
+// handful of buffers per revision (the raw chunk, the reconstructed text and
+// the previous text), so keeping that many avoids going through the
+// allocator in steady state.
+const RECYCLED_SLOTS: usize = 4;
+
+type RecycledAlloc = Option<(NonNull<u8>, Layout)>;
+
 thread_local! {
-    static RECYCLED_ALLOC: Cell<Option<(NonNull<u8>, Layout)>> = const { Cell::new(None) };
+    static RECYCLED_ALLOC: Cell<[RecycledAlloc; RECYCLED_SLOTS]> =
+        const { Cell::new([None; RECYCLED_SLOTS]) };
 }
 
 unsafe fn alloc_recycle(layout: Layout) -> (*mut u8, usize) {
     RECYCLED_ALLOC.with(|recycled| {
-        if let Some((ptr, recycled_layout)) = recycled.get() {
-            if layout.size() <= recycled_layout.size() && layout.align() == recycled_layout.align()
-            {
-                recycled.take();
-                return (ptr.as_ptr(), recycled_layout.size());
-            }
+        let mut slots = recycled.get();
+        // Take the smallest recycled allocation that fits.
+        if let Some(slot) = slots
+            .iter_mut()
+            .filter(|slot| {
+                slot.map_or(false, |(_, recycled_layout)| {
+                    layout.size() <= recycled_layout.size()
+                        && layout.align() == recycled_layout.align()
+                })
+            })
+            .min_by_key(|slot| slot.unwrap().1.size())
+        {
+            let (ptr, recycled_layout) = slot.take().unwrap();
+            recycled.set(slots);
+            return (ptr.as_ptr(), recycled_layout.size());
         }
         (std::alloc::alloc(layout), layout.size())
     })
@@ -477,13 +495,21 @@ unsafe fn alloc_recycle(layout: Layout) -> (*mut u8, usize) {
 
 unsafe fn dealloc_keep(ptr: *mut u8, layout: Layout) {
     RECYCLED_ALLOC.with(|recycled| {
-        let to_dealloc = Cell::new(Some((NonNull::new(ptr).unwrap(), layout)));
-        if recycled.get().map_or(true, |(_, recycled_layout)| {
+        let mut slots = recycled.get();
+        let mut to_dealloc = Some((NonNull::new(ptr).unwrap(), layout));
+        // Keep the allocation in an empty slot, or in place of the smallest
+        // recycled one if it's larger.
+        let slot = slots
+            .iter_mut()
+            .min_by_key(|slot| slot.map_or(0, |(_, recycled_layout)| recycled_layout.size()))
+            .unwrap();
+        if slot.map_or(true, |(_, recycled_layout)| {
             recycled_layout.size() < layout.size()
         }) {
-            to_dealloc.swap(recycled);
+            mem::swap(slot, &mut to_dealloc);
+            recycled.set(slots);
         }
-        if let Some((ptr, layout)) = to_dealloc.take() {
+        if let Some((ptr, layout)) = to_dealloc {
             std::alloc::dealloc(ptr.as_ptr(), layout);
         }
     });
@@ -2,6 +2,7 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+use std::cmp;
 use std::ffi::c_void;
 use std::marker::PhantomData;
 use std::os::raw::{c_char, c_int, c_long, c_ulong};
@@ -170,6 +171,141 @@ pub fn textdiff<'a>(a: &[u8], b: &'a [u8]) -> impl Iterator<Item = PatchInfo<&'a
     ctx.patch_info.into_iter()
 }
 
+// Polynomial rolling hash over fixed-size windows.
+struct RollingHash {
+    // BASE raised to the power of the window size minus one, for removing
+    // the byte leaving the window.
+    out_factor: u32,
+}
+
+impl RollingHash {
+    const BASE: u32 = 0x0100_0193;
+
+    fn new(window: usize) -> Self {
+        RollingHash {
+            out_factor: (1..window).fold(1u32, |f, _| f.wrapping_mul(Self::BASE)),
+        }
+    }
+
+    // Bytes are offset by one so that runs of zeroes still contribute.
+    fn hash(&self, window: &[u8]) -> u32 {
+        window.iter().fold(0, |h, &c| {
+            h.wrapping_mul(Self::BASE).wrapping_add(u32::from(c) + 1)
+        })
+    }
+
+    fn roll(&self, h: u32, out: u8, r#in: u8) -> u32 {
+        h.wrapping_sub((u32::from(out) + 1).wrapping_mul(self.out_factor))
+            .wrapping_mul(Self::BASE)
+            .wrapping_add(u32::from(r#in) + 1)
+    }
+}
+
+// Spread the hash bits before using the top ones as a bucket number.
+fn hash_bucket(h: u32, bits: u32) -> usize {
+    (h.wrapping_mul(0x9e37_79b1) >> (32 - bits)) as usize
+}
+
+/// Diff meant for binary or very large inputs, for which a line-based diff
+/// is slow and memory hungry. Blocks of `a` are indexed by a rolling hash,
+/// which is then used to find them at any offset in `b`. Only matches
+/// further in `a` than the previous one are used, so that the result is a
+/// valid sequence of patches.
+pub fn blockdiff<'a>(a: &[u8], b: &'a [u8]) -> impl Iterator<Item = PatchInfo<&'a [u8]>> {
+    const MIN_BLOCK_SIZE: usize = 64;
+    // Bounds the size of the index for very large inputs.
+    const MAX_BLOCKS: usize = 1 << 20;
+    // Bounds the work for blocks that appear many times in `a`.
+    const MAX_CANDIDATES: usize = 16;
+
+    let block_size = cmp::max(MIN_BLOCK_SIZE, a.len() / MAX_BLOCKS + 1);
+    let mut patch_info = Vec::new();
+    let (mut a_pos, mut b_pos) = (0, 0);
+    if a.len() >= block_size && b.len() >= block_size {
+        let hasher = RollingHash::new(block_size);
+        // Index the blocks of `a` in a hash table with about two buckets
+        // per block, laid out contiguously, and ordered by offset within
+        // each bucket. Most windows of `b` won't match anything, and will
+        // fall in an empty bucket.
+        let hashes = a
+            .chunks_exact(block_size)
+            .map(|block| hasher.hash(block))
+            .collect::<Vec<_>>();
+        let bucket_bits = (hashes.len() * 2).next_power_of_two().trailing_zeros();
+        let mut buckets = vec![0u32; (1 << bucket_bits) + 1];
+        for &h in &hashes {
+            buckets[hash_bucket(h, bucket_bits) + 1] += 1;
+        }
+        for n in 1..buckets.len() {
+            buckets[n] += buckets[n - 1];
+        }
+        let mut index = vec![(0, 0); hashes.len()];
+        for (n, &h) in hashes.iter().enumerate() {
+            let next = &mut buckets[hash_bucket(h, bucket_bits)];
+            index[*next as usize] = (h, u32::try_from(n * block_size).unwrap());
+            *next += 1;
+        }
+        // Each bucket start was moved to the next bucket's start.
+        let last = buckets.len() - 1;
+        buckets.copy_within(..last, 1);
+        buckets[0] = 0;
+        drop(hashes);
+
+        let mut j = 0;
+        let mut h = hasher.hash(&b[..block_size]);
+        while j + block_size <= b.len() {
+            let bucket = hash_bucket(h, bucket_bits);
+            let bucket = &index[buckets[bucket] as usize..buckets[bucket + 1] as usize];
+            let first = bucket.partition_point(|&(_, offset)| (offset as usize) < a_pos);
+            let found = bucket[first..]
+                .iter()
+                .filter(|&&(bh, _)| bh == h)
+                .take(MAX_CANDIDATES)
+                .map(|&(_, offset)| offset as usize)
+                .find(|&i| a[i..i + block_size] == b[j..j + block_size]);
+            if let Some(mut i) = found {
+                // Extend the match backwards over what wasn't matched yet,
+                // then forwards.
+                let mut start = j;
+                while i > a_pos && start > b_pos && a[i - 1] == b[start - 1] {
+                    i -= 1;
+                    start -= 1;
+                }
+                let mut len = j - start + block_size;
+                while i + len < a.len() && start + len < b.len() && a[i + len] == b[start + len] {
+                    len += 1;
+                }
+                if i > a_pos || start > b_pos {
+                    patch_info.push(PatchInfo {
+                        start: a_pos,
+                        end: i,
+                        data: &b[b_pos..start],
+                    });
+                }
+                a_pos = i + len;
+                b_pos = start + len;
+                j = b_pos;
+                if j + block_size <= b.len() {
+                    h = hasher.hash(&b[j..j + block_size]);
+                }
+            } else {
+                if j + block_size < b.len() {
+                    h = hasher.roll(h, b[j], b[j + block_size]);
+                }
+                j += 1;
+            }
+        }
+    }
+    if a_pos < a.len() || b_pos < b.len() {
+        patch_info.push(PatchInfo {
+            start: a_pos,
+            end: a.len(),
+            data: &b[b_pos..],
+        });
+    }
+    patch_info.into_iter()
+}
+
 #[test]
 fn test_textdiff() {
     let a = ["foo", "bar", "baz", "qux"].join("\n");
@@ -220,3 +356,71 @@ fn test_textdiff() {
         ]
     );
 }
+
+#[test]
+fn test_blockdiff() {
+    // Deterministic pseudo-random data with few newlines.
+    let mut state = 0x1234_5678u32;
+    let a = (0..100_000)
+        .map(|_| {
+            state = state.wrapping_mul(1_103_515_245).wrapping_add(12345);
+            (state >> 16) as u8
+        })
+        .collect::<Vec<_>>();
+
+    assert_eq!(blockdiff(&a, &a).count(), 0);
+    assert_eq!(
+        blockdiff(b"", b"foo").collect::<Vec<_>>(),
+        vec![PatchInfo {
+            start: 0,
+            end: 0,
+            data: b"foo".as_bstr()
+        }]
+    );
+    assert_eq!(
+        blockdiff(b"foo", b"").collect::<Vec<_>>(),
+        vec![PatchInfo {
+            start: 0,
+            end: 3,
+            data: b"".as_bstr()
+        }]
+    );
+
+    let mut b = a.clone();
+    // Modify some bytes.
+    b[1000..1010].copy_from_slice(b"0123456789");
+    // Insert data.
+    b.splice(20_000..20_000, b"inserted data".iter().copied());
+    // Remove data.
+    b.drain(50_000..51_000);
+    // Change the end.
+    b.truncate(99_000);
+    b.extend_from_slice(b"new end");
+    let patch = blockdiff(&a, &b).collect::<Vec<_>>();
+    assert_eq!(&*apply(patch.iter().cloned(), &a), &b[..]);
+    assert_eq!(
+        patch,
+        vec![
+            PatchInfo {
+                start: 1000,
+                end: 1010,
+                data: b"0123456789".as_bstr()
+            },
+            PatchInfo {
+                start: 20_000,
+                end: 20_000,
+                data: b"inserted data".as_bstr()
+            },
+            PatchInfo {
+                start: 49_987,
+                end: 50_987,
+                data: b"".as_bstr()
+            },
+            PatchInfo {
+                start: 99_987,
+                end: 100_000,
+                data: b"new end".as_bstr()
+            },
+        ]
+    );
+}